@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <string.h>
+#include "asyncloader.h"
+#include "loadercache.h"
+#include "loader.h"
+#include "system.h"
+
+/* the serial port prefix used when searching for a port doesn't matter on most systems */
+#if defined(LINUX) && !defined(RASPBERRY_PI)
+  #define PORT_PREFIX "ttyUSB"
+#elif defined(RASPBERRY_PI)
+  #define PORT_PREFIX "ttyAMA"
+#elif defined(MACOSX)
+  #define PORT_PREFIX "cu.usbserial-"
+#else
+  #define PORT_PREFIX ""
+#endif
+
+struct LoadContext {
+    LoadEventHandler *handler;
+    int errorCode;
+};
+
+static void ForwardEvent(void *data, const MessageEvent *event)
+{
+    LoadContext *context = (LoadContext *)data;
+    if (event->code > 99)
+        context->errorCode = event->code;
+    if (*context->handler)
+        (*context->handler)(*event);
+}
+
+static int RunLoad(const LoadRequest &request, LoaderCache &cache)
+{
+    BoardConfig *config, *configSettings;
+    PropConnection *connection;
+    std::string board, subtype;
+    Loader loader;
+    size_t colon;
+    int sts;
+
+    /* build the include path for this thread */
+    xbClearPath();
+    std::list<std::string>::const_iterator i = request.includePath.begin();
+    while (i != request.includePath.end()) {
+        xbAddPath(i->c_str());
+        ++i;
+    }
+    xbAddFilePath(request.file.c_str());
+    xbAddEnvironmentPath("PROPELLER_LOAD_PATH");
+#if defined(LINUX) || defined(MACOSX) || defined(CYGWIN)
+    xbAddPath("/opt/parallax/propeller-load");
+#endif
+
+    /* find the board configuration */
+    board = request.board.empty() ? DEF_BOARD : request.board;
+    subtype = DEF_SUBTYPE;
+    if ((colon = board.find(':')) != std::string::npos) {
+        subtype = board.substr(colon + 1);
+        board.erase(colon);
+    }
+    if (!(config = cache.getConfig(board.c_str(), "")) || !(config = GetConfigSubtype(config, subtype.c_str()))) {
+        message("117-Can't find board configuration '%s'", request.board.c_str());
+        return -1;
+    }
+
+    /* apply the overrides */
+    configSettings = NewBoardConfig(NULL, "");
+    std::list<std::pair<std::string, std::string> >::const_iterator j = request.settings.begin();
+    while (j != request.settings.end()) {
+        SetConfigField(configSettings, j->first.c_str(), j->second.c_str());
+        ++j;
+    }
+    config = MergeConfigs(config, configSettings);
+
+    /* open the connection */
+    if (request.useSerial)
+        connection = cache.getSerialConnection(PORT_PREFIX, request.port.empty() ? NULL : request.port.c_str(), GetConfigField(config, "usb-serial"));
+    else
+        connection = cache.getWiFiConnection(request.ipaddr.empty() ? NULL : request.ipaddr.c_str());
+    if (!connection) {
+        FreeBoardConfig(configSettings);
+        return -1;
+    }
+    if (LoaderCache::configure(connection, config) != 0) {
+        cache.release(connection, true);
+        FreeBoardConfig(configSettings);
+        return -1;
+    }
+
+    /* load the file */
+    message("001-Opening file '%s'", request.file.c_str());
+    loader.setConnection(connection);
+    if ((sts = loader.fastLoadFile(request.file.c_str(), request.loadType)) != 0)
+        message("102-Download failed: %d", sts);
+    else
+        message("005-Download successful!");
+
+    cache.release(connection, sts != 0);
+    FreeBoardConfig(configSettings);
+
+    return sts;
+}
+
+int Load(const LoadRequest &request, LoadEventHandler handler)
+{
+    LoadContext context;
+    LoaderCache cache;
+    int sts;
+
+    /* send this thread's messages to the caller's handler */
+    context.handler = &handler;
+    context.errorCode = 0;
+    SetMessageHandler(ForwardEvent, &context);
+    verbose = request.verbose;
+
+    sts = RunLoad(request, cache);
+
+    SetMessageHandler(NULL, NULL);
+    xbClearPath();
+
+    /* report failures by the code of the last error message */
+    if (sts != 0)
+        return context.errorCode ? context.errorCode : 102;
+
+    return 0;
+}
+
+std::future<int> LoadAsync(const LoadRequest &request, LoadEventHandler handler)
+{
+    return std::async(std::launch::async, Load, request, handler);
+}
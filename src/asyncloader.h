@@ -0,0 +1,36 @@
+#ifndef __ASYNCLOADER_H__
+#define __ASYNCLOADER_H__
+
+#include <string>
+#include <list>
+#include <utility>
+#include <functional>
+#include <future>
+#include "propconnection.h"
+#include "proploader.h"
+
+// a load to be run by LoadAsync
+class LoadRequest {
+public:
+    LoadRequest() : useSerial(false), loadType(ltDownloadAndRun), verbose(0) {}
+    std::string file;                   // .binary or .elf file to load
+    std::string board;                  // <type> or <type>:<subtype> (empty for the default board)
+    std::string port;                   // serial port (empty to use the first port found)
+    std::string ipaddr;                 // wifi module address (empty to use the first module found)
+    bool useSerial;
+    LoadType loadType;
+    std::list<std::string> includePath; // directories to search for board configurations
+    std::list<std::pair<std::string, std::string> > settings;   // board configuration overrides
+    int verbose;                        // also report debugging messages (code 0)
+};
+
+// receives the messages and progress updates for one load on the thread running it
+typedef std::function<void (const MessageEvent &event)> LoadEventHandler;
+
+// run a load on its own thread (the result is 0 or the code of the message reporting the failure)
+std::future<int> LoadAsync(const LoadRequest &request, LoadEventHandler handler = LoadEventHandler());
+
+// run a load on the calling thread
+int Load(const LoadRequest &request, LoadEventHandler handler = LoadEventHandler());
+
+#endif
@@ -25,10 +25,14 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 #include <string.h>
 #include <ctype.h>
 #include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include "config.h"
 #include "system.h"
 #include "expr.h"
+#include "proploader.h"
 
 #define MAXLINE 1024
 
@@ -39,12 +43,42 @@ struct Field {
     Field *next;
 };
 
+/* an entry in the flattened view of a configuration and its parents */
+typedef struct {
+    Field *field;           /* field or NULL for an empty slot */
+    unsigned int hash;      /* hash of the lowercase tag */
+    int state;              /* state of the numeric value */
+    int value;              /* numeric value once it has been evaluated */
+} CompiledField;
+
+/* numeric value states */
+#define NUMERIC_UNKNOWN     0
+#define NUMERIC_BUSY        1
+#define NUMERIC_VALID       2
+#define NUMERIC_INVALID     3
+
+#define MIN_COMPILED_SIZE   32
+
+/* the configuration file a board configuration was read from */
+typedef struct {
+    char *name;             /* name looked up in the include path */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+} ConfigSource;
+
 struct BoardConfig {
     BoardConfig *parent;
     BoardConfig *sibling;
     BoardConfig *child;
     BoardConfig **pNextChild;
     Field *fields;
+    unsigned int version;       /* configVersion when the fields or parent last changed */
+    CompiledField *compiled;    /* flattened view of this configuration and its parents */
+    int compiledSize;           /* number of slots (a power of two) */
+    unsigned int compiledVersion; /* configVersion when the flattened view was built */
+    ConfigSource *source;       /* file this configuration was parsed from */
     char name[1];
 };
 
@@ -91,19 +125,32 @@ static ConfigSymbol configSymbols[] = {
 {   NULL,           0           }
 };
 
+/* incremented each time any configuration changes so flattened views know when to rebuild */
+static unsigned int configVersion = 0;
+
+/* each thread has its own default configuration that is freed along with everything parsed from it when the thread exits */
+static __thread BoardConfig *defaultConfig = NULL;
+static pthread_key_t defaultConfigKey;
+static pthread_once_t defaultConfigOnce = PTHREAD_ONCE_INIT;
+
 static void DumpFields(BoardConfig *config, Field *fields, int indent);
+static void ConfigChanged(BoardConfig *config);
+static CompiledField *FindCompiledField(BoardConfig *config, const char *tag);
+static void UnlinkBoardConfig(BoardConfig *config);
+static void FreeBoardConfigTree(BoardConfig *config);
+static int GetSourceInfo(FILE *fp, const char *name, ConfigSource *source);
 static BoardConfig *GetDefaultConfiguration(void);
 static int SkipSpaces(LineBuf *buf);
 static char *NextToken(LineBuf *buf, const char *termSet, int *pTerm);
 static int FindSymbol(void *cookie, const char *name, int *pValue);
-static void ParseError(LineBuf *buf, const char *fmt, ...);
+static BoardConfig *ParseError(FILE *fp, LineBuf *buf, BoardConfig *config, const char *fmt, ...);
 static void Fatal(const char *fmt, ...);
 
 BoardConfig *NewBoardConfig(BoardConfig *parent, const char *name)
 {
     BoardConfig *config;
     if (!(config = (BoardConfig *)malloc(sizeof(BoardConfig) + strlen(name))))
-        Fatal("insufficient memory");
+        Fatal("Insufficient memory");
     memset(config, 0, sizeof(BoardConfig));
     strcpy(config->name, name);
     config->parent = parent;
@@ -112,9 +159,58 @@ BoardConfig *NewBoardConfig(BoardConfig *parent, const char *name)
         *parent->pNextChild = config;
         parent->pNextChild = &config->sibling;
     }
+    ConfigChanged(config);
     return config;
 }
 
+/* FreeBoardConfig - free a configuration and its subtypes (nothing else may still use it as a parent) */
+void FreeBoardConfig(BoardConfig *config)
+{
+    /* the default configuration is returned by ParseConfigurationFile but belongs to the thread */
+    if (config == defaultConfig)
+        return;
+    UnlinkBoardConfig(config);
+    FreeBoardConfigTree(config);
+}
+
+/* UnlinkBoardConfig - remove a configuration from its parent's list of subtypes */
+static void UnlinkBoardConfig(BoardConfig *config)
+{
+    BoardConfig *parent = config->parent, **pNext;
+    
+    /* configurations merged with MergeConfigs point at a parent that doesn't list them */
+    if (!parent)
+        return;
+    for (pNext = &parent->child; *pNext != NULL; pNext = &(*pNext)->sibling) {
+        if (*pNext == config) {
+            *pNext = config->sibling;
+            if (parent->pNextChild == &config->sibling)
+                parent->pNextChild = pNext;
+            break;
+        }
+    }
+}
+
+static void FreeBoardConfigTree(BoardConfig *config)
+{
+    BoardConfig *subconfig, *nextConfig;
+    Field *field, *next;
+    for (subconfig = config->child; subconfig != NULL; subconfig = nextConfig) {
+        nextConfig = subconfig->sibling;
+        FreeBoardConfigTree(subconfig);
+    }
+    for (field = config->fields; field != NULL; field = next) {
+        next = field->next;
+        free(field);
+    }
+    if (config->source) {
+        free(config->source->name);
+        free(config->source);
+    }
+    free(config->compiled);
+    free(config);
+}
+
 /* ParseConfigurationFile - parse a configuration file */
 BoardConfig *ParseConfigurationFile(const char *name)
 {
@@ -145,6 +241,14 @@ BoardConfig *ParseConfigurationFile(const char *name)
     /* create a new board configuration */
     baseConfig = config = NewBoardConfig(GetDefaultConfiguration(), name);
     
+    /* remember the file so ConfigurationFileChanged can tell when it has been edited */
+    if ((baseConfig->source = (ConfigSource *)malloc(sizeof(ConfigSource))) != NULL) {
+        if (!GetSourceInfo(fp, path, baseConfig->source)) {
+            free(baseConfig->source);
+            baseConfig->source = NULL;
+        }
+    }
+    
     /* initialize the line number */
     buf.lineNumber = 0;
         
@@ -180,14 +284,14 @@ BoardConfig *ParseConfigurationFile(const char *name)
             /* get the configuration name */
             ++buf.linePtr;
             if (!(tag = NextToken(&buf, "]", &ch)))
-                ParseError(&buf, "missing configuration tag");
+                return ParseError(fp, &buf, baseConfig, "missing configuration tag");
             if (ch != ']') {
                 if (SkipSpaces(&buf) != ']')
-                    ParseError(&buf, "missing close bracket after configuration tag");
+                    return ParseError(fp, &buf, baseConfig, "missing close bracket after configuration tag");
                 ++buf.linePtr;
             }
             if (SkipSpaces(&buf) != '\0')
-                ParseError(&buf, "missing end of line");
+                return ParseError(fp, &buf, baseConfig, "missing end of line");
                 
             /* add a new board configuration */
             config = NewBoardConfig(baseConfig, tag);
@@ -197,12 +301,12 @@ BoardConfig *ParseConfigurationFile(const char *name)
         
             /* get the tag */
             if (!(tag = NextToken(&buf, ":", &ch)))
-                ParseError(&buf, "missing tag");
+                return ParseError(fp, &buf, baseConfig, "missing tag");
                 
             /* check for the colon separator */
             if (ch != ':') {
                 if (SkipSpaces(&buf) != ':')
-                    ParseError(&buf, "missing colon");
+                    return ParseError(fp, &buf, baseConfig, "missing colon");
                 ++buf.linePtr;
             }
             
@@ -222,6 +326,47 @@ BoardConfig *ParseConfigurationFile(const char *name)
     return baseConfig;
 }
 
+/* ConfigurationFileChanged - check whether the file a configuration was parsed from has changed */
+int ConfigurationFileChanged(BoardConfig *config)
+{
+    ConfigSource current;
+    int changed;
+    FILE *fp;
+    
+    /* the default configuration and configurations built in memory never change */
+    if (!config->source)
+        return FALSE;
+    
+    /* look the name up again in case a different file would now be found first */
+    if (!(fp = xbOpenFileInPath(config->source->name, "r")))
+        return TRUE;
+    if (!GetSourceInfo(fp, NULL, &current))
+        changed = TRUE;
+    else
+        changed = current.dev != config->source->dev
+               || current.ino != config->source->ino
+               || current.size != config->source->size
+               || current.mtime != config->source->mtime;
+    fclose(fp);
+    
+    return changed;
+}
+
+static int GetSourceInfo(FILE *fp, const char *name, ConfigSource *source)
+{
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0)
+        return FALSE;
+    source->dev = st.st_dev;
+    source->ino = st.st_ino;
+    source->size = st.st_size;
+    source->mtime = st.st_mtime;
+    source->name = NULL;
+    if (name && !(source->name = strdup(name)))
+        return FALSE;
+    return TRUE;
+}
+
 /* DumpBoardConfiguration - dump a board configuration */
 void DumpBoardConfiguration(BoardConfig *config)
 {
@@ -274,9 +419,10 @@ void SetConfigField(BoardConfig *config, const char *tag, const char *value)
             free(field);
             break;
         }
+    ConfigChanged(config);
     taglen = strlen(tag) + 1;
     if (!(field = (Field *)malloc(sizeof(Field) + taglen + strlen(value) + 1)))
-        Fatal("insufficient memory");
+        Fatal("Insufficient memory");
     field->tag = (char *)field + sizeof(Field);
     field->value = field->tag + taglen;
     strcpy(field->tag, tag);
@@ -287,40 +433,156 @@ void SetConfigField(BoardConfig *config, const char *tag, const char *value)
 
 char *GetConfigField(BoardConfig *config, const char *tag)
 {
-    while (config != NULL) {
-        Field *field;
-        for (field = config->fields; field != NULL; field = field->next)
-            if (strcasecmp(tag, field->tag) == 0)
-                return field->value;
-        config = config->parent;
-    }
-    return NULL;
+    CompiledField *entry;
+    if (!(entry = FindCompiledField(config, tag)))
+        return NULL;
+    return entry->field->value;
 }
 
+/* GetNumericConfigField - get a numeric field evaluating its expression only the first time it is used */
 int GetNumericConfigField(BoardConfig *config, const char *tag, int *pValue)
 {
+    CompiledField *entry;
     ParseContext c;
-    char *value;
-    if (!(value = GetConfigField(config, tag)))
+    int value;
+    
+    if (!(entry = FindCompiledField(config, tag)))
         return FALSE;
+    
+    switch (entry->state) {
+    case NUMERIC_VALID:
+        *pValue = entry->value;
+        return TRUE;
+    case NUMERIC_BUSY:      /* the expression refers to itself */
+    case NUMERIC_INVALID:
+        return FALSE;
+    }
+    
+    /* symbols in the expression are looked up from the same configuration */
+    entry->state = NUMERIC_BUSY;
     c.findSymbol = FindSymbol;
     c.cookie = config;
-    return ParseNumericExpr(&c, value, pValue);
+    if (!ParseNumericExpr(&c, entry->field->value, &value)) {
+        entry->state = NUMERIC_INVALID;
+        return FALSE;
+    }
+    entry->state = NUMERIC_VALID;
+    entry->value = value;
+    *pValue = value;
+    
+    return TRUE;
 }
 
 BoardConfig *MergeConfigs(BoardConfig *parent, BoardConfig *child)
 {
     child->parent = parent;
+    ConfigChanged(child);
     return child;
 }
 
+/* ConfigChanged - mark a configuration as changed so views that include it get rebuilt */
+static void ConfigChanged(BoardConfig *config)
+{
+    config->version = __sync_add_and_fetch(&configVersion, 1);
+}
+
+static unsigned int HashTag(const char *tag)
+{
+    unsigned int hash = 2166136261u;
+    while (*tag)
+        hash = (hash ^ (unsigned char)tolower(*tag++)) * 16777619u;
+    return hash;
+}
+
+/* CompileConfig - flatten a configuration and its parents into a hash table with the nearest setting of each tag */
+static int CompileConfig(BoardConfig *config)
+{
+    BoardConfig *c;
+    CompiledField *entry;
+    Field *field;
+    int count = 0, size, mask;
+    
+    /* size the table for every field in the chain so the load factor stays at or below one half */
+    for (c = config; c != NULL; c = c->parent)
+        for (field = c->fields; field != NULL; field = field->next)
+            ++count;
+    for (size = MIN_COMPILED_SIZE; size < count * 2; size *= 2)
+        ;
+    
+    /* get the current version before walking the chain so a concurrent change can't be missed */
+    config->compiledVersion = __sync_add_and_fetch(&configVersion, 0);
+    
+    free(config->compiled);
+    config->compiledSize = 0;
+    if (!(config->compiled = (CompiledField *)calloc(size, sizeof(CompiledField))))
+        return FALSE;
+    config->compiledSize = size;
+    mask = size - 1;
+    
+    /* settings nearer the configuration hide the same tag in its parents */
+    for (c = config; c != NULL; c = c->parent) {
+        for (field = c->fields; field != NULL; field = field->next) {
+            unsigned int hash = HashTag(field->tag);
+            int i = hash & mask;
+            while ((entry = &config->compiled[i])->field != NULL) {
+                if (entry->hash == hash && strcasecmp(field->tag, entry->field->tag) == 0)
+                    break;
+                i = (i + 1) & mask;
+            }
+            if (!entry->field) {
+                entry->field = field;
+                entry->hash = hash;
+                entry->state = NUMERIC_UNKNOWN;
+            }
+        }
+    }
+    
+    return TRUE;
+}
+
+/* FindCompiledField - find a tag in the flattened view of a configuration rebuilding the view if it is out of date */
+static CompiledField *FindCompiledField(BoardConfig *config, const char *tag)
+{
+    CompiledField *entry;
+    unsigned int hash;
+    BoardConfig *c;
+    int i, mask;
+    
+    /* rebuild if anything in the chain changed since the view was built */
+    for (c = config; c != NULL; c = c->parent)
+        if (!config->compiled || c->version > config->compiledVersion) {
+            if (!CompileConfig(config))
+                Fatal("Insufficient memory");
+            break;
+        }
+    
+    hash = HashTag(tag);
+    mask = config->compiledSize - 1;
+    for (i = hash & mask; (entry = &config->compiled[i])->field != NULL; i = (i + 1) & mask)
+        if (entry->hash == hash && strcasecmp(tag, entry->field->tag) == 0)
+            return entry;
+    
+    return NULL;
+}
+
 /* these default settings match the Parallax ActivityBoard */
 
+static void FreeDefaultConfiguration(void *data)
+{
+    FreeBoardConfigTree((BoardConfig *)data);
+}
+
+static void CreateDefaultConfigKey(void)
+{
+    pthread_key_create(&defaultConfigKey, FreeDefaultConfiguration);
+}
+
 static BoardConfig *GetDefaultConfiguration(void)
 {
-    static BoardConfig *defaultConfig = NULL;
     if (!defaultConfig) {
         defaultConfig = NewBoardConfig(NULL, DEF_BOARD);
+        pthread_once(&defaultConfigOnce, CreateDefaultConfigKey);
+        pthread_setspecific(defaultConfigKey, defaultConfig);
         SetConfigField(defaultConfig, "clkfreq",                    "80000000");
         SetConfigField(defaultConfig, "clkmode",                    "XTAL1+PLL16X");
         SetConfigField(defaultConfig, "baudrate",                   "115200");
@@ -391,28 +653,29 @@ static int FindSymbol(void *cookie, const char *name, int *pValue)
     return FALSE;
 }
 
-static void ParseError(LineBuf *buf, const char *fmt, ...)
+/* report a configuration file error and give up on the file */
+static BoardConfig *ParseError(FILE *fp, LineBuf *buf, BoardConfig *config, const char *fmt, ...)
 {
+    char text[256];
     va_list ap;
     va_start(ap, fmt);
-    printf("error: ");
-    vprintf(fmt, ap);
-    putchar('\n');
-    if (buf) {
-        printf("  on line number %d\n", buf->lineNumber);
-        printf("%s\n", buf->lineBuf);
-    }
+    vsnprintf(text, sizeof(text), fmt, ap);
     va_end(ap);
-    exit(1);
+    message("111-%s on line number %d\n%s", text, buf->lineNumber, buf->lineBuf);
+    FreeBoardConfig(config);
+    fclose(fp);
+    return NULL;
 }
 
+/* the configuration API has no way to report running out of memory so give up */
 static void Fatal(const char *fmt, ...)
 {
+    char text[256];
     va_list ap;
     va_start(ap, fmt);
-    printf("error: ");
-    vprintf(fmt, ap);
-    putchar('\n');
+    vsnprintf(text, sizeof(text), fmt, ap);
     va_end(ap);
+    message("999-%s", text);
+    FlushMessages();
     exit(1);
 }
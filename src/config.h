@@ -46,7 +46,9 @@ typedef struct BoardConfig BoardConfig;
 #define DEF_SUBTYPE "default"
 
 BoardConfig *NewBoardConfig(BoardConfig *parent, const char *name);
+void FreeBoardConfig(BoardConfig *config);
 BoardConfig *ParseConfigurationFile(const char *path);
+int ConfigurationFileChanged(BoardConfig *config);
 void DumpBoardConfiguration(BoardConfig *config);
 BoardConfig *GetConfigSubtype(BoardConfig *config, const char *name);
 BoardConfig *MergeConfigs(BoardConfig *parent, BoardConfig *child);
@@ -0,0 +1,170 @@
+/* crc16.cpp - table driven CRC-16/XMODEM
+
+  The packet protocol has always used the byte at a time "augmented" form of this crc
+  (feed the data followed by two zero bytes through updcrc). That is equivalent to the
+  direct form computed here with an initial value of zero so the results are identical.
+
+  Eight bytes are folded into the crc on each step using "slicing-by-8" tables. Table k
+  gives the crc contribution of a byte that is followed by k more bytes in the block.
+*/
+
+#include "crc16.h"
+
+static uint16_t crcTables[8][256];
+
+static struct CRCTableInit {
+    CRCTableInit()
+    {
+        int b, bit, k;
+
+        /* table 0 is the usual byte at a time table */
+        for (b = 0; b < 256; ++b) {
+            uint16_t crc = (uint16_t)(b << 8);
+            for (bit = 0; bit < 8; ++bit)
+                crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+            crcTables[0][b] = crc;
+        }
+
+        /* each following table advances the previous one by a zero byte */
+        for (k = 1; k < 8; ++k) {
+            for (b = 0; b < 256; ++b) {
+                uint16_t crc = crcTables[k - 1][b];
+                crcTables[k][b] = (uint16_t)(crc << 8) ^ crcTables[0][crc >> 8];
+            }
+        }
+    }
+} crcTableInit;
+
+uint16_t UpdateCRC16(uint16_t crc, const uint8_t *buf, int len)
+{
+    /* fold in eight bytes at a time */
+    while (len >= 8) {
+        crc = crcTables[7][buf[0] ^ (crc >> 8)]
+            ^ crcTables[6][buf[1] ^ (crc & 0xff)]
+            ^ crcTables[5][buf[2]]
+            ^ crcTables[4][buf[3]]
+            ^ crcTables[3][buf[4]]
+            ^ crcTables[2][buf[5]]
+            ^ crcTables[1][buf[6]]
+            ^ crcTables[0][buf[7]];
+        buf += 8;
+        len -= 8;
+    }
+
+    /* handle whatever is left a byte at a time */
+    while (--len >= 0)
+        crc = (uint16_t)(crc << 8) ^ crcTables[0][(crc >> 8) ^ *buf++];
+
+    return crc;
+}
+
+#ifdef TEST_CRC16
+
+/*
+   Checks the slicing-by-8 crc against a bit at a time reference and times it
+   against the byte at a time augmented updcrc loop the packet code used before.
+
+   g++ -Wall -O2 -DTEST_CRC16 src/crc16.cpp -o crcbench
+   crcbench [megabytes]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+#define updcrc(crc, ch) (crcTables[0][((crc) >> 8) & 0xff] ^ ((crc) << 8) ^ (ch))
+
+static uint16_t ReferenceCRC16(const uint8_t *buf, int len)
+{
+    uint16_t crc = 0;
+    int bit;
+    while (--len >= 0) {
+        crc ^= (uint16_t)(*buf++ << 8);
+        for (bit = 0; bit < 8; ++bit)
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+static uint16_t AugmentedCRC16(const uint8_t *buf, int len)
+{
+    uint16_t crc = 0;
+    while (--len >= 0)
+        crc = updcrc(crc, *buf++);
+    crc = updcrc(crc, '\0');
+    crc = updcrc(crc, '\0');
+    return crc;
+}
+
+/* the first byte changes on each pass so the compiler can't hoist the crc out of the loop */
+static double TimeCRC(uint16_t (*crcfn)(const uint8_t *buf, int len), uint8_t *buf, int len, int count, uint16_t *pCRC)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint8_t first = buf[0];
+    uint16_t crc = 0;
+    int i;
+    for (i = 0; i < count; ++i) {
+        buf[0] = (uint8_t)(first + i);
+        crc ^= (*crcfn)(buf, len);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    buf[0] = first;
+    *pCRC = crc;
+    return elapsed.count();
+}
+
+int main(int argc, char *argv[])
+{
+    static const int sizes[] = { 1024, 65536 };
+    int megabytes = argc > 1 ? atoi(argv[1]) : 256;
+    int maxSize = sizes[1], errors = 0, len, split, i;
+    uint8_t *buf;
+
+    if (!(buf = (uint8_t *)malloc(maxSize))) {
+        printf("error: insufficient memory\n");
+        return 1;
+    }
+    srand(1);
+    for (i = 0; i < maxSize; ++i)
+        buf[i] = (uint8_t)rand();
+
+    /* every length up to a few blocks and every split of a short one */
+    for (len = 0; len <= 1100; ++len) {
+        uint16_t expected = ReferenceCRC16(buf, len);
+        if (CRC16(buf, len) != expected || AugmentedCRC16(buf, len) != expected) {
+            printf("error: crc mismatch, len %d\n", len);
+            ++errors;
+        }
+        if (len <= 64) {
+            for (split = 0; split <= len; ++split) {
+                if (UpdateCRC16(CRC16(buf, split), buf + split, len - split) != expected) {
+                    printf("error: crc mismatch, len %d split at %d\n", len, split);
+                    ++errors;
+                }
+            }
+        }
+    }
+    if (CRC16(buf, maxSize) != ReferenceCRC16(buf, maxSize)) {
+        printf("error: crc mismatch, len %d\n", maxSize);
+        ++errors;
+    }
+    printf("check: %s\n", errors ? "FAILED" : "ok");
+
+    for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); ++i) {
+        int count = (int)(((long long)megabytes << 20) / sizes[i]);
+        uint16_t oldCRC, newCRC;
+        double oldTime = TimeCRC(AugmentedCRC16, buf, sizes[i], count, &oldCRC);
+        double newTime = TimeCRC(CRC16, buf, sizes[i], count, &newCRC);
+        printf("%6d byte blocks: updcrc %7.1f MB/s, slicing-by-8 %7.1f MB/s, %.1fx%s\n",
+               sizes[i],
+               megabytes / oldTime,
+               megabytes / newTime,
+               oldTime / newTime,
+               oldCRC == newCRC ? "" : " (MISMATCH)");
+    }
+
+    free(buf);
+    return errors ? 1 : 0;
+}
+
+#endif // TEST_CRC16
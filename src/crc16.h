@@ -0,0 +1,17 @@
+#ifndef __CRC16_H__
+#define __CRC16_H__
+
+#include <stdint.h>
+
+/* CRC-16/XMODEM (polynomial 0x1021, initial value 0) as used by the packet protocol */
+
+/* update a running crc with a buffer of data */
+uint16_t UpdateCRC16(uint16_t crc, const uint8_t *buf, int len);
+
+/* compute the crc of a buffer of data */
+inline uint16_t CRC16(const uint8_t *buf, int len)
+{
+    return UpdateCRC16(0, buf, len);
+}
+
+#endif
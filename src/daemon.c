@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+
+#ifndef __MINGW32__
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#endif
+
+#include "daemon.h"
+#include "proploader.h"
+
+/*
+   A request is a 4 byte big-endian length followed by that many bytes of
+   NUL terminated strings: the client's working directory and then its
+   arguments. The daemon sends back whatever the load writes to stdout
+   followed by a NUL byte and the decimal exit status. Loads never write
+   NUL bytes because terminal mode isn't available through the daemon.
+*/
+
+#define MAX_REQUEST     (64 * 1024)
+#define MAX_ARGS        256
+
+/* seconds a client has to send its request before it's dropped */
+#define REQUEST_TIMEOUT 5
+
+/* RunRequest results */
+#define REQUEST_OK          0
+#define REQUEST_MALFORMED   -1
+#define REQUEST_TIMED_OUT   -2
+
+#ifdef __MINGW32__
+
+int RunDaemon(const char *socketPath, DaemonJob *job, void *data)
+{
+    printf("error: daemon mode is not supported on this platform\n");
+    return -1;
+}
+
+int RunClient(const char *socketPath, int argc, char *argv[])
+{
+    printf("error: daemon mode is not supported on this platform\n");
+    return -1;
+}
+
+#else
+
+static int OpenDaemonSocket(const char *socketPath, struct sockaddr_un *addr)
+{
+    int sock;
+
+    if (strlen(socketPath) >= sizeof(addr->sun_path)) {
+        printf("error: socket path too long: %s\n", socketPath);
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, socketPath);
+
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        printf("error: can't create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return sock;
+}
+
+static int WriteAll(int fd, const void *buf, int len)
+{
+    const char *p = (const char *)buf;
+    int cnt;
+    while (len > 0) {
+        if ((cnt = write(fd, p, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += cnt;
+        len -= cnt;
+    }
+    return 0;
+}
+
+static int ReadAll(int fd, void *buf, int len)
+{
+    char *p = (char *)buf;
+    int cnt;
+    while (len > 0) {
+        if ((cnt = read(fd, p, len)) <= 0) {
+            if (cnt < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += cnt;
+        len -= cnt;
+    }
+    return 0;
+}
+
+/* ReadRequest - read part of a request and say why it couldn't be read */
+static int ReadRequest(int client, void *buf, int len)
+{
+    errno = 0;
+    if (ReadAll(client, buf, len) == 0)
+        return REQUEST_OK;
+    return errno == EAGAIN || errno == EWOULDBLOCK ? REQUEST_TIMED_OUT : REQUEST_MALFORMED;
+}
+
+static int RunRequest(int client, DaemonJob *job, void *data)
+{
+    char *request, *argv[MAX_ARGS + 1], *cwd, *p, *end, status[16];
+    int argc, stdoutFd, savedVerbose, sts;
+    uint8_t hdr[4];
+    uint32_t len;
+
+    /* read the request */
+    if ((sts = ReadRequest(client, hdr, sizeof(hdr))) != REQUEST_OK)
+        return sts;
+    len = ((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16) | ((uint32_t)hdr[2] << 8) | hdr[3];
+    if (len == 0 || len > MAX_REQUEST || !(request = (char *)malloc(len + 1)))
+        return REQUEST_MALFORMED;
+    if ((sts = ReadRequest(client, request, len)) != REQUEST_OK) {
+        free(request);
+        return sts;
+    }
+    request[len] = '\0';
+
+    /* split it into the working directory and the arguments */
+    cwd = request;
+    p = cwd + strlen(cwd) + 1;
+    end = request + len;
+    for (argc = 0; p < end && argc < MAX_ARGS; ++argc) {
+        argv[argc] = p;
+        p += strlen(p) + 1;
+    }
+    argv[argc] = NULL;
+
+    if (argc == 0 || chdir(cwd) != 0) {
+        free(request);
+        return REQUEST_MALFORMED;
+    }
+
+    message("Running request from %s", cwd);
+
+    /* send the load's output to the client */
+    fflush(stdout);
+    if ((stdoutFd = dup(STDOUT_FILENO)) < 0 || dup2(client, STDOUT_FILENO) < 0) {
+        if (stdoutFd >= 0)
+            close(stdoutFd);
+        free(request);
+        return REQUEST_MALFORMED;
+    }
+
+    savedVerbose = verbose;
+    sts = (*job)(data, argc, argv);
+    verbose = savedVerbose;
+
+    /* restore the daemon's own stdout */
+    fflush(stdout);
+    dup2(stdoutFd, STDOUT_FILENO);
+    close(stdoutFd);
+    free(request);
+
+    /* send the exit status */
+    status[0] = '\0';
+    snprintf(&status[1], sizeof(status) - 1, "%d", sts);
+    WriteAll(client, status, 1 + strlen(&status[1]));
+
+    message("Request finished with status %d", sts);
+
+    return REQUEST_OK;
+}
+
+int RunDaemon(const char *socketPath, DaemonJob *job, void *data)
+{
+    struct sockaddr_un addr;
+    struct timeval timeout;
+    struct stat st;
+    int sock, client;
+
+    if ((sock = OpenDaemonSocket(socketPath, &addr)) < 0)
+        return -1;
+
+    /* remove a socket left behind by a previous daemon */
+    if (stat(socketPath, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(socketPath);
+
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 8) != 0) {
+        printf("error: can't listen on %s: %s\n", socketPath, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    /* a client going away mustn't take the daemon with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    message("016-[ Waiting for load requests on %s ]", socketPath);
+
+    /* handle one request at a time since they share the target connections */
+    for (;;) {
+        if ((client = accept(sock, NULL, NULL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            printf("error: accept failed: %s\n", strerror(errno));
+            break;
+        }
+
+        /* a client that connects and then sends nothing mustn't stall the daemon */
+        timeout.tv_sec = REQUEST_TIMEOUT;
+        timeout.tv_usec = 0;
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        switch (RunRequest(client, job, data)) {
+        case REQUEST_MALFORMED:
+            message("Ignoring malformed request");
+            break;
+        case REQUEST_TIMED_OUT:
+            message("Dropping request not received within %d seconds", REQUEST_TIMEOUT);
+            break;
+        }
+        close(client);
+    }
+
+    close(sock);
+    unlink(socketPath);
+    return -1;
+}
+
+int RunClient(const char *socketPath, int argc, char *argv[])
+{
+    char cwd[PATH_MAX], *request, *p, buf[1024];
+    struct sockaddr_un addr;
+    int sock, len, cnt, i;
+    uint8_t hdr[4];
+
+    if (!getcwd(cwd, sizeof(cwd))) {
+        printf("error: can't get the current directory\n");
+        return -1;
+    }
+
+    /* build the request */
+    len = strlen(cwd) + 1;
+    for (i = 0; i < argc; ++i)
+        len += strlen(argv[i]) + 1;
+    if (len > MAX_REQUEST || argc > MAX_ARGS) {
+        printf("error: request too long\n");
+        return -1;
+    }
+    if (!(request = (char *)malloc(len))) {
+        printf("error: insufficient memory\n");
+        return -1;
+    }
+    strcpy(request, cwd);
+    p = request + strlen(cwd) + 1;
+    for (i = 0; i < argc; ++i) {
+        strcpy(p, argv[i]);
+        p += strlen(argv[i]) + 1;
+    }
+    hdr[0] = len >> 24;
+    hdr[1] = len >> 16;
+    hdr[2] = len >> 8;
+    hdr[3] = len;
+
+    if ((sock = OpenDaemonSocket(socketPath, &addr)) < 0) {
+        free(request);
+        return -1;
+    }
+
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        printf("error: can't connect to daemon at %s: %s\n", socketPath, strerror(errno));
+        free(request);
+        close(sock);
+        return -1;
+    }
+
+    if (WriteAll(sock, hdr, sizeof(hdr)) != 0 || WriteAll(sock, request, len) != 0) {
+        printf("error: can't send request to daemon\n");
+        free(request);
+        close(sock);
+        return -1;
+    }
+    free(request);
+
+    /* copy the output until the NUL that introduces the exit status */
+    for (;;) {
+        if ((cnt = read(sock, buf, sizeof(buf) - 1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (cnt == 0)
+            break;
+        if ((p = memchr(buf, '\0', cnt)) != NULL) {
+            fwrite(buf, 1, p - buf, stdout);
+            fflush(stdout);
+
+            /* collect the rest of the status */
+            len = cnt - (int)(p - buf) - 1;
+            memmove(buf, p + 1, len);
+            while (len < (int)sizeof(buf) - 1 && (cnt = read(sock, buf + len, sizeof(buf) - 1 - len)) > 0)
+                len += cnt;
+            buf[len] = '\0';
+            close(sock);
+            return atoi(buf);
+        }
+        fwrite(buf, 1, cnt, stdout);
+        fflush(stdout);
+    }
+
+    close(sock);
+    printf("error: daemon closed the connection without a status\n");
+    return -1;
+}
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* run one load request with the daemon's stdout connected to the client */
+typedef int DaemonJob(void *data, int argc, char *argv[]);
+
+/* serve load requests on a unix-domain socket until killed */
+int RunDaemon(const char *socketPath, DaemonJob *job, void *data);
+
+/* submit a load request to a daemon and return its exit status */
+int RunClient(const char *socketPath, int argc, char *argv[]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
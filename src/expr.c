@@ -5,6 +5,7 @@
 #include <string.h>
 #include <ctype.h>
 #include "expr.h"
+#include "proploader.h"
 
 #define TRUE    1
 #define FALSE   0
@@ -469,12 +470,12 @@ static void ParseConfigVariable(ParseContext *c, int *pValue)
 static void Error(ParseContext *c, const char *fmt, ...)
 {
     if (c->showErrors) {
+        char text[256];
         va_list ap;
         va_start(ap, fmt);
-        printf("error: ");
-        vprintf(fmt, ap);
-        putchar('\n');
+        vsnprintf(text, sizeof(text), fmt, ap);
         va_end(ap);
+        message("120-Invalid expression: %s", text);
     }
     longjmp(c->errorTarget, 1);
 }
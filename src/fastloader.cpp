@@ -113,9 +113,14 @@ int Loader::fastLoadFile(const char *file, LoadType loadType)
     int imageSize;
     int sts;
     
+    /* reset the target while the file is read and the loader image is prepared */
+    if (m_connection->startLoad() != 0)
+        return -1;
+    
     /* make sure the image was loaded into memory */
     if (!(image = readFile(file, &imageSize))) {
         message("Failed to load image '%s'", file);
+        m_connection->cancelLoad();
         return -1;
     }
     
@@ -138,8 +143,10 @@ int Loader::fastLoadImage(const uint8_t *image, int imageSize, LoadType loadType
 
     /* generate a loader image */
     loaderImage = generateInitialLoaderImage(packetID, &loaderImageSize);
-    if (!loaderImage)
+    if (!loaderImage) {
+        m_connection->cancelLoad();
         return -1;
+    }
         
     /* compute the image checksum */
     checksum = 0;
@@ -175,7 +182,7 @@ int Loader::fastLoadImage(const uint8_t *image, int imageSize, LoadType loadType
     remaining = imageSize;
     while (remaining > 0) {
         int size;
-        progress("008-%ld bytes remaining             ", (long)remaining);
+        progressBytes((long)(imageSize - remaining), (long)imageSize);
         if ((size = remaining) > m_connection->maxDataSize())
             size = m_connection->maxDataSize();
         if (transmitPacket(packetID, image, size, &result) != 0)
@@ -0,0 +1,92 @@
+#include <string.h>
+#include "framereader.h"
+
+FrameReader::FrameReader(FILE *fp, int type, int maxLength, int padTo)
+    : m_fp(fp), m_type(type), m_maxLength(maxLength), m_padTo(padTo), m_head(0), m_tail(0), m_count(0), m_eof(false), m_error(false), m_stop(false)
+{
+    int i;
+
+    /* a frame that can't be allocated is reported as a read error */
+    for (i = 0; i < FRAMEREADER_DEPTH; ++i) {
+        if (!m_frames[i].allocate(maxLength)) {
+            m_error = m_eof = true;
+            return;
+        }
+    }
+
+    m_thread = std::thread(&FrameReader::run, this);
+}
+
+FrameReader::~FrameReader()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_space.notify_one();
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+/* get the next frame waiting for the reader if necessary (returns NULL at the end of the file) */
+PacketFrame *FrameReader::nextFrame()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_ready.wait(lock, [this] { return m_count > 0 || m_eof; });
+    return m_count > 0 ? &m_frames[m_tail] : NULL;
+}
+
+/* give the frame returned by nextFrame back to the reader */
+void FrameReader::releaseFrame()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tail = (m_tail + 1) % FRAMEREADER_DEPTH;
+        --m_count;
+    }
+    m_space.notify_one();
+}
+
+void FrameReader::run()
+{
+    PacketFrame *frame;
+    size_t cnt;
+
+    for (;;) {
+
+        /* wait for a free frame */
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_space.wait(lock, [this] { return m_count < FRAMEREADER_DEPTH || m_stop; });
+            if (m_stop)
+                return;
+            frame = &m_frames[m_head];
+        }
+
+        /* read the payload directly into the frame and compute its crc outside of the lock */
+        cnt = fread(&frame->data[PKTHDRLEN], 1, m_maxLength, m_fp);
+        if (cnt > 0 && cnt % m_padTo != 0) {
+            size_t padding = m_padTo - cnt % m_padTo;
+            memset(&frame->data[PKTHDRLEN + cnt], 0, padding);
+            cnt += padding;
+        }
+        if (cnt > 0)
+            frame->format(m_type, &frame->data[PKTHDRLEN], (int)cnt);
+
+        /* hand the frame to the sender or signal the end of the file */
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (cnt > 0) {
+                m_head = (m_head + 1) % FRAMEREADER_DEPTH;
+                ++m_count;
+            }
+            else {
+                m_error = ferror(m_fp) != 0;
+                m_eof = true;
+            }
+        }
+        m_ready.notify_one();
+        if (cnt == 0)
+            return;
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef __FRAMEREADER_H__
+#define __FRAMEREADER_H__
+
+#include <stdio.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "packet.h"
+
+/* number of frames the reader can get ahead of the sender */
+#define FRAMEREADER_DEPTH   16
+
+/* reads a file on a separate thread into a ring of ready-to-send frames */
+class FrameReader {
+public:
+    FrameReader(FILE *fp, int type, int maxLength = PKTDEFLEN, int padTo = 1);
+    ~FrameReader();
+    PacketFrame *nextFrame();
+    void releaseFrame();
+    bool readError() { return m_error; }
+private:
+    void run();
+
+    FILE *m_fp;
+    int m_type;
+    int m_maxLength;
+    int m_padTo;                        // pad the last payload with zeros to a multiple of this
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_ready;    // signalled when a frame is added or the file ends
+    std::condition_variable m_space;    // signalled when a frame is released or the reader should stop
+    PacketFrame m_frames[FRAMEREADER_DEPTH];
+    int m_head;                         // next frame to fill
+    int m_tail;                         // next frame to send
+    int m_count;                        // number of frames ready to send
+    bool m_eof;
+    bool m_error;
+    bool m_stop;
+};
+
+#endif
@@ -0,0 +1,195 @@
+/*
+ * gpio_chardev.c
+ *
+ * GPIO output lines using the Linux GPIO character device (/dev/gpiochipN).
+ *
+ * Unlike the sysfs interface the line is requested once and stays open so
+ * setting it is a single ioctl and a reset pulse can be timed to a few
+ * microseconds. This uses the v2 line API directly so there is no
+ * dependency on libgpiod. Kernels without it (before 5.10) fail to open
+ * lines and the caller falls back to sysfs.
+ *
+ * The test at the end can be run against the gpio-sim module:
+ *
+ *   gcc -DTEST_GPIO_CHARDEV -o gpio_chardev gpio_chardev.c
+ *   ./gpio_chardev /dev/gpiochipN 0 10000
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+#include "gpio_chardev.h"
+
+#define CONSUMER    "proploader"
+
+struct GPIOLine {
+    int fd;             /* line request descriptor */
+    int offset;         /* line offset on the chip */
+    char chip[64];      /* path to the chip */
+};
+
+static void ChipPath(const char *chip, char *path, int size);
+
+GPIOLine *GpioLineOpen(const char *chip, int offset, int value)
+{
+#ifdef GPIO_V2_GET_LINE_IOCTL
+    struct gpio_v2_line_request req;
+    GPIOLine *line;
+    int chipfd;
+
+    if (!(line = (GPIOLine *)malloc(sizeof(GPIOLine))))
+        return NULL;
+    ChipPath(chip, line->chip, sizeof(line->chip));
+    line->offset = offset;
+
+    if ((chipfd = open(line->chip, O_RDWR | O_CLOEXEC)) < 0) {
+        free(line);
+        return NULL;
+    }
+
+    /* request the line as an output already at its initial value so it doesn't glitch */
+    memset(&req, 0, sizeof(req));
+    req.offsets[0] = offset;
+    req.num_lines = 1;
+    strncpy(req.consumer, CONSUMER, sizeof(req.consumer) - 1);
+    req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+    req.config.num_attrs = 1;
+    req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+    req.config.attrs[0].attr.values = value ? 1 : 0;
+    req.config.attrs[0].mask = 1;
+
+    if (ioctl(chipfd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+        close(chipfd);
+        free(line);
+        return NULL;
+    }
+    close(chipfd);
+
+    line->fd = req.fd;
+    return line;
+#else
+    return NULL;
+#endif
+}
+
+void GpioLineClose(GPIOLine *line)
+{
+    close(line->fd);
+    free(line);
+}
+
+int GpioLineMatches(GPIOLine *line, const char *chip, int offset)
+{
+    char path[sizeof(line->chip)];
+    ChipPath(chip, path, sizeof(path));
+    return offset == line->offset && strcmp(path, line->chip) == 0;
+}
+
+int GpioLineSet(GPIOLine *line, int value)
+{
+#ifdef GPIO_V2_GET_LINE_IOCTL
+    struct gpio_v2_line_values values;
+    values.bits = value ? 1 : 0;
+    values.mask = 1;
+    return ioctl(line->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0 ? -1 : 0;
+#else
+    return -1;
+#endif
+}
+
+int GpioLineGet(GPIOLine *line)
+{
+#ifdef GPIO_V2_GET_LINE_IOCTL
+    struct gpio_v2_line_values values;
+    values.bits = 0;
+    values.mask = 1;
+    if (ioctl(line->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0)
+        return -1;
+    return (int)(values.bits & 1);
+#else
+    return -1;
+#endif
+}
+
+/* time the pulse against an absolute deadline so a late wakeup doesn't add to the next step */
+int GpioLinePulse(GPIOLine *line, int value, int usecs)
+{
+    struct timespec deadline;
+
+    if (GpioLineSet(line, value) != 0)
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    deadline.tv_sec += usecs / 1000000;
+    deadline.tv_nsec += (long)(usecs % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_nsec -= 1000000000;
+        ++deadline.tv_sec;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+        ;
+
+    return GpioLineSet(line, !value);
+}
+
+/* accept "/dev/gpiochip0", "gpiochip0" or "0" */
+static void ChipPath(const char *chip, char *path, int size)
+{
+    if (!chip || !*chip)
+        chip = GPIO_DEFAULT_CHIP;
+    if (*chip == '/')
+        snprintf(path, size, "%s", chip);
+    else if (strncmp(chip, "gpiochip", 8) == 0)
+        snprintf(path, size, "/dev/%s", chip);
+    else
+        snprintf(path, size, "/dev/gpiochip%s", chip);
+}
+
+#ifdef TEST_GPIO_CHARDEV
+
+static long ElapsedMicroseconds(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* This test pulses a line low and checks the value and the pulse width */
+int main(int argc, char *argv[])
+{
+    struct timespec start, end;
+    GPIOLine *line;
+    int usecs, i;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s chip offset [pulse-usecs]\n", argv[0]);
+        return 1;
+    }
+    usecs = argc > 3 ? atoi(argv[3]) : 10000;
+
+    if (!(line = GpioLineOpen(argv[1], atoi(argv[2]), 1))) {
+        fprintf(stderr, "Failed to request %s line %s: %s\n", argv[1], argv[2], strerror(errno));
+        return 2;
+    }
+    printf("Requested %s line %s, value %d\n", argv[1], argv[2], GpioLineGet(line));
+
+    for (i = 0; i < 5; ++i) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (GpioLinePulse(line, 0, usecs) != 0) {
+            fprintf(stderr, "Failed to pulse line: %s\n", strerror(errno));
+            return 3;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("Pulse %d: requested %d us, took %ld us, value after %d\n", i, usecs, ElapsedMicroseconds(&start, &end), GpioLineGet(line));
+    }
+
+    GpioLineClose(line);
+    return 0;
+}
+
+#endif // TEST_GPIO_CHARDEV
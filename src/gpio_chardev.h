@@ -0,0 +1,25 @@
+#ifndef GPIO_CHARDEV_H
+#define GPIO_CHARDEV_H
+
+/* default chip for pin numbers given without one (the Raspberry Pi header pins) */
+#define GPIO_DEFAULT_CHIP   "/dev/gpiochip0"
+
+typedef struct GPIOLine GPIOLine;
+
+/* request a line as an output with an initial value (returns NULL if the chip or line isn't available) */
+GPIOLine *GpioLineOpen(const char *chip, int offset, int value);
+
+/* release the line */
+void GpioLineClose(GPIOLine *line);
+
+/* check whether an open line is the given line */
+int GpioLineMatches(GPIOLine *line, const char *chip, int offset);
+
+/* set or get the value of the line */
+int GpioLineSet(GPIOLine *line, int value);
+int GpioLineGet(GPIOLine *line);
+
+/* drive the line to value for usecs microseconds then back again */
+int GpioLinePulse(GPIOLine *line, int value, int usecs);
+
+#endif // GPIO_CHARDEV_H
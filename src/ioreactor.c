@@ -0,0 +1,329 @@
+#include <stdlib.h>
+#include <errno.h>
+
+#ifdef __MINGW32__
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <time.h>
+#include <poll.h>
+#ifdef LINUX
+#include <unistd.h>
+#include <sys/epoll.h>
+#endif
+#endif
+
+#include "ioreactor.h"
+
+/* maximum number of epoll events handled by one call to IOReactorDispatch */
+#define IO_MAX_EVENTS   32
+
+/* IOTimeNow - get the current time in milliseconds */
+int64_t IOTimeNow(void)
+{
+#ifdef __MINGW32__
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (int64_t)(now.QuadPart * 1000 / freq.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+#endif
+}
+
+/* IODeadline - get the deadline for a timeout in milliseconds (negative means no deadline) */
+int64_t IODeadline(int timeout)
+{
+    return timeout < 0 ? IO_NO_DEADLINE : IOTimeNow() + timeout;
+}
+
+/* IOTimeRemaining - get the number of milliseconds until a deadline (-1 if there is none) */
+int IOTimeRemaining(int64_t deadline)
+{
+    int64_t remaining;
+    if (deadline == IO_NO_DEADLINE)
+        return -1;
+    remaining = deadline - IOTimeNow();
+    return remaining > 0 ? (int)remaining : 0;
+}
+
+#ifdef __MINGW32__
+
+/* winsock has no poll so wait using select which isn't limited by the value of the socket */
+static int WaitSocket(int fd, int write, int64_t deadline)
+{
+    struct timeval toval, *ptoval = NULL;
+    int timeout, cnt;
+    fd_set set;
+
+    FD_ZERO(&set);
+    FD_SET((SOCKET)fd, &set);
+
+    if ((timeout = IOTimeRemaining(deadline)) >= 0) {
+        toval.tv_sec = timeout / 1000;
+        toval.tv_usec = (timeout % 1000) * 1000;
+        ptoval = &toval;
+    }
+
+    if ((cnt = select(fd + 1, write ? NULL : &set, write ? &set : NULL, NULL, ptoval)) < 0)
+        return -1;
+
+    return cnt > 0 ? 1 : 0;
+}
+
+int IOWaitReadable(int fd, int64_t deadline)
+{
+    return WaitSocket(fd, 0, deadline);
+}
+
+int IOWaitWritable(int fd, int64_t deadline)
+{
+    return WaitSocket(fd, 1, deadline);
+}
+
+#else
+
+/* wait for events on a single descriptor retrying if interrupted by a signal */
+static int WaitDescriptor(int fd, short events, int64_t deadline)
+{
+    struct pollfd pfd;
+    int cnt;
+
+    pfd.fd = fd;
+    pfd.events = events;
+
+    do {
+        pfd.revents = 0;
+        cnt = poll(&pfd, 1, IOTimeRemaining(deadline));
+    } while (cnt < 0 && errno == EINTR);
+
+    if (cnt < 0)
+        return -1;
+
+    return cnt > 0 ? 1 : 0;
+}
+
+int IOWaitReadable(int fd, int64_t deadline)
+{
+    return WaitDescriptor(fd, POLLIN, deadline);
+}
+
+int IOWaitWritable(int fd, int64_t deadline)
+{
+    return WaitDescriptor(fd, POLLOUT, deadline);
+}
+
+typedef struct IOEntry IOEntry;
+struct IOEntry {
+    int fd;
+    int events;
+    IOHandler *handler;
+    void *data;
+    int removed;        // removed while dispatching, freed when dispatching is done
+    IOEntry *next;
+};
+
+struct IOReactor {
+#ifdef LINUX
+    int epfd;
+#else
+    struct pollfd *pfds;    // poll arrays rebuilt on each dispatch
+    IOEntry **pentries;
+    int capacity;
+#endif
+    IOEntry *entries;
+    int count;
+    int dispatching;
+};
+
+IOReactor *IOReactorCreate(void)
+{
+    IOReactor *reactor;
+
+    if (!(reactor = (IOReactor *)malloc(sizeof(IOReactor))))
+        return NULL;
+    reactor->entries = NULL;
+    reactor->count = 0;
+    reactor->dispatching = 0;
+
+#ifdef LINUX
+    if ((reactor->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        free(reactor);
+        return NULL;
+    }
+#else
+    reactor->pfds = NULL;
+    reactor->pentries = NULL;
+    reactor->capacity = 0;
+#endif
+
+    return reactor;
+}
+
+void IOReactorDestroy(IOReactor *reactor)
+{
+    IOEntry *entry, *next;
+    for (entry = reactor->entries; entry != NULL; entry = next) {
+        next = entry->next;
+        free(entry);
+    }
+#ifdef LINUX
+    close(reactor->epfd);
+#else
+    free(reactor->pfds);
+    free(reactor->pentries);
+#endif
+    free(reactor);
+}
+
+int IOReactorAdd(IOReactor *reactor, int fd, int events, IOHandler *handler, void *data)
+{
+    IOEntry *entry;
+
+    if (!(entry = (IOEntry *)malloc(sizeof(IOEntry))))
+        return -1;
+    entry->fd = fd;
+    entry->events = events;
+    entry->handler = handler;
+    entry->data = data;
+    entry->removed = 0;
+
+#ifdef LINUX
+    {
+        struct epoll_event event;
+        event.events = (events & IO_READ ? EPOLLIN : 0) | (events & IO_WRITE ? EPOLLOUT : 0);
+        event.data.ptr = entry;
+        if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            free(entry);
+            return -1;
+        }
+    }
+#endif
+
+    entry->next = reactor->entries;
+    reactor->entries = entry;
+    ++reactor->count;
+
+    return 0;
+}
+
+int IOReactorRemove(IOReactor *reactor, int fd)
+{
+    IOEntry **pNext, *entry;
+
+    for (pNext = &reactor->entries; (entry = *pNext) != NULL; pNext = &entry->next) {
+        if (entry->fd == fd && !entry->removed) {
+#ifdef LINUX
+            epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+            if (reactor->dispatching)
+                entry->removed = 1;
+            else {
+                *pNext = entry->next;
+                free(entry);
+            }
+            --reactor->count;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* free the entries removed by handlers */
+static void PurgeRemoved(IOReactor *reactor)
+{
+    IOEntry **pNext = &reactor->entries, *entry;
+    while ((entry = *pNext) != NULL) {
+        if (entry->removed) {
+            *pNext = entry->next;
+            free(entry);
+        }
+        else
+            pNext = &entry->next;
+    }
+}
+
+static void Dispatch(IOReactor *reactor, IOEntry *entry, int events)
+{
+    if (!entry->removed && (events &= entry->events | IO_ERROR) != 0)
+        (*entry->handler)(reactor, entry->fd, events, entry->data);
+}
+
+/* IOReactorDispatch - wait until the deadline for events and call their handlers (returns the number of events, 0 on timeout, -1 on error) */
+int IOReactorDispatch(IOReactor *reactor, int64_t deadline)
+{
+#ifdef LINUX
+    struct epoll_event events[IO_MAX_EVENTS];
+    int cnt, i;
+
+    do {
+        cnt = epoll_wait(reactor->epfd, events, IO_MAX_EVENTS, IOTimeRemaining(deadline));
+    } while (cnt < 0 && errno == EINTR);
+
+    if (cnt < 0)
+        return -1;
+
+    reactor->dispatching = 1;
+    for (i = 0; i < cnt; ++i) {
+        uint32_t revents = events[i].events;
+        Dispatch(reactor, (IOEntry *)events[i].data.ptr,
+                   (revents & (EPOLLIN | EPOLLHUP) ? IO_READ : 0)
+                 | (revents & EPOLLOUT ? IO_WRITE : 0)
+                 | (revents & EPOLLERR ? IO_ERROR : 0));
+    }
+    reactor->dispatching = 0;
+#else
+    struct pollfd *pfds;
+    IOEntry **entries, *entry;
+    int cnt, n, i;
+
+    /* make sure there is room for every descriptor */
+    if (reactor->count > reactor->capacity) {
+        int capacity = reactor->count * 2;
+        if (!(pfds = (struct pollfd *)realloc(reactor->pfds, capacity * sizeof(struct pollfd))))
+            return -1;
+        reactor->pfds = pfds;
+        if (!(entries = (IOEntry **)realloc(reactor->pentries, capacity * sizeof(IOEntry *))))
+            return -1;
+        reactor->pentries = entries;
+        reactor->capacity = capacity;
+    }
+    pfds = reactor->pfds;
+    entries = reactor->pentries;
+
+    /* poll has no registration so build the descriptor array each time */
+    for (n = 0, entry = reactor->entries; entry != NULL; entry = entry->next) {
+        pfds[n].fd = entry->fd;
+        pfds[n].events = (entry->events & IO_READ ? POLLIN : 0) | (entry->events & IO_WRITE ? POLLOUT : 0);
+        pfds[n].revents = 0;
+        entries[n++] = entry;
+    }
+
+    do {
+        cnt = poll(pfds, n, IOTimeRemaining(deadline));
+    } while (cnt < 0 && errno == EINTR);
+
+    if (cnt < 0)
+        return -1;
+
+    reactor->dispatching = 1;
+    for (i = 0; i < n; ++i) {
+        short revents = pfds[i].revents;
+        if (revents)
+            Dispatch(reactor, entries[i],
+                       (revents & (POLLIN | POLLHUP) ? IO_READ : 0)
+                     | (revents & POLLOUT ? IO_WRITE : 0)
+                     | (revents & (POLLERR | POLLNVAL) ? IO_ERROR : 0));
+    }
+    reactor->dispatching = 0;
+#endif
+
+    PurgeRemoved(reactor);
+
+    return cnt;
+}
+
+#endif
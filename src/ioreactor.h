@@ -0,0 +1,53 @@
+#ifndef __IOREACTOR_H__
+#define __IOREACTOR_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* deadlines are absolute times in milliseconds on a monotonic clock */
+#define IO_NO_DEADLINE  ((int64_t)-1)
+
+int64_t IOTimeNow(void);
+int64_t IODeadline(int timeout);
+int IOTimeRemaining(int64_t deadline);
+
+/*
+ * Wait for a single descriptor (returns 1 when ready, 0 on timeout, -1 on error).
+ * The serial and socket transports use these rather than registering with a
+ * reactor because each of their calls blocks the thread that owns the
+ * connection until one descriptor is ready, and connections are used from
+ * different threads (ports are identified in parallel). poll on one
+ * descriptor costs the same however many are open and has no FD_SETSIZE
+ * limit. An IOReactor is for one thread serving several descriptors at once
+ * like the terminal.
+ */
+int IOWaitReadable(int fd, int64_t deadline);
+int IOWaitWritable(int fd, int64_t deadline);
+
+#ifndef __MINGW32__
+
+/* events */
+#define IO_READ     0x01
+#define IO_WRITE    0x02
+#define IO_ERROR    0x04
+
+typedef struct IOReactor IOReactor;
+typedef void IOHandler(IOReactor *reactor, int fd, int events, void *data);
+
+/* wait for events on any number of descriptors (epoll on linux, poll elsewhere) */
+IOReactor *IOReactorCreate(void);
+void IOReactorDestroy(IOReactor *reactor);
+int IOReactorAdd(IOReactor *reactor, int fd, int events, IOHandler *handler, void *data);
+int IOReactorRemove(IOReactor *reactor, int fd);
+int IOReactorDispatch(IOReactor *reactor, int64_t deadline);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
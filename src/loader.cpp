@@ -14,9 +14,15 @@ int Loader::loadFile(const char *file, LoadType loadType)
     int imageSize;
     int sts;
     
+    /* reset the target while the file is read */
+    if (m_connection->startLoad() != 0)
+        return -1;
+    
     /* make sure the image was loaded into memory */
-    if (!(image = readFile(file, &imageSize)))
+    if (!(image = readFile(file, &imageSize))) {
+        m_connection->cancelLoad();
         return -1;
+    }
     
     /* load the file */
     sts = loadImage(image, imageSize, loadType);
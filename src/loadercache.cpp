@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <ctype.h>
+#include "loadercache.h"
+#include "proploader.h"
+
+/*
+   A normal run of the loader makes a single pass through these functions
+   and the connections it opens are closed when the process exits. The
+   daemon keeps a cache that holds on to everything between loads so only
+   the first load pays for parsing board configurations, discovering and
+   opening serial ports and wifi modules and checking module firmware.
+   A load that fails drops the connection it used so the next one starts
+   over in case the target went away.
+*/
+
+LoaderCache::LoaderCache(bool keepWarm)
+    : m_keepWarm(keepWarm)
+{
+}
+
+LoaderCache::~LoaderCache()
+{
+    ConfigMap::iterator k = m_configs.begin();
+    while (k != m_configs.end()) {
+        FreeBoardConfig(k->second);
+        ++k;
+    }
+    std::list<BoardConfig *>::iterator l = m_parsedConfigs.begin();
+    while (l != m_parsedConfigs.end()) {
+        FreeBoardConfig(*l);
+        ++l;
+    }
+    SerialConnectionMap::iterator i = m_serialConnections.begin();
+    while (i != m_serialConnections.end()) {
+        delete i->second;
+        ++i;
+    }
+    WiFiConnectionMap::iterator j = m_wifiConnections.begin();
+    while (j != m_wifiConnections.end()) {
+        delete j->second;
+        ++j;
+    }
+    WiFiPropConnection::finishModuleCacheRefresh();
+}
+
+/* configurations are found using the include path so the same board name can mean different files for different loads */
+BoardConfig *LoaderCache::getConfig(const char *board, const std::string &searchPath)
+{
+    BoardConfig *config;
+    std::string key;
+    const char *p;
+
+    /* still keep the configuration so it is freed with the cache */
+    if (!m_keepWarm) {
+        if ((config = ParseConfigurationFile(board)) != NULL)
+            m_parsedConfigs.push_back(config);
+        return config;
+    }
+
+    for (p = board; *p; ++p)
+        key += tolower(*p);
+    key += '\n';
+    key += searchPath;
+
+    /* reuse the parsed configuration until its .cfg file is edited */
+    ConfigMap::iterator i = m_configs.find(key);
+    if (i != m_configs.end()) {
+        if (!ConfigurationFileChanged(i->second))
+            return i->second;
+        message("Reloading configuration for '%s'", board);
+        FreeBoardConfig(i->second);
+        m_configs.erase(i);
+    }
+
+    /* the cached configurations are shared so -D settings must only ever be merged on top of them */
+    if ((config = ParseConfigurationFile(board)) != NULL)
+        m_configs[key] = config;
+
+    return config;
+}
+
+/* serialNumber picks the adapter by its USB serial number when no port is given */
+SerialPropConnection *LoaderCache::getSerialConnection(const char *portPrefix, const char *port, const char *serialNumber)
+{
+    SerialPropConnection *connection;
+    SerialInfoList ports;
+    int sts;
+
+    /* use the port found by the last search if it's still open (finding a port by serial number doesn't open anything) */
+    if (!port && !serialNumber && !m_defaultPort.empty())
+        port = m_defaultPort.c_str();
+
+    if (port) {
+        SerialConnectionMap::iterator i = m_serialConnections.find(port);
+        if (i != m_serialConnections.end()) {
+            message("Reusing connection to %s", port);
+            return i->second;
+        }
+    }
+
+    if (!(connection = new SerialPropConnection)) {
+        message("999-Insufficient memory");
+        return NULL;
+    }
+
+    if (!port) {
+        if (SerialPropConnection::findPorts(portPrefix, true, ports, 1, serialNumber) != 0) {
+            message("112-Serial port discovery failed");
+            delete connection;
+            return NULL;
+        }
+        if (ports.size() == 0) {
+            message("113-No serial ports found");
+            delete connection;
+            return NULL;
+        }
+        port = ports.front().port();
+        if (m_keepWarm && !serialNumber)
+            m_defaultPort = port;
+    }
+
+    if ((sts = connection->open(port)) != 0) {
+        message("114-Loader initialization failed: %d", sts);
+        m_defaultPort.clear();
+        delete connection;
+        return NULL;
+    }
+
+    m_serialConnections[port] = connection;
+
+    return connection;
+}
+
+WiFiPropConnection *LoaderCache::getWiFiConnection(const char *ipaddr)
+{
+    WiFiPropConnection *connection;
+    bool useCache = true;
+    bool fromCache = false;
+    std::string address;
+
+    /* use the module found by the last discovery if we're still connected to it */
+    if (!ipaddr && !m_defaultAddress.empty())
+        ipaddr = m_defaultAddress.c_str();
+
+    if (ipaddr) {
+        WiFiConnectionMap::iterator i = m_wifiConnections.find(ipaddr);
+        if (i != m_wifiConnections.end()) {
+            message("Reusing connection to %s", ipaddr);
+            return i->second;
+        }
+        address = ipaddr;
+    }
+
+    if (!(connection = new WiFiPropConnection)) {
+        message("999-Insufficient memory");
+        return NULL;
+    }
+
+    for (;;) {
+        if (address.empty()) {
+            WiFiInfoList addrs;
+            if (WiFiPropConnection::findModules(false, addrs, 1, useCache, m_keepWarm) != 0) {
+                message("115-Wi-Fi module discovery failed");
+                delete connection;
+                return NULL;
+            }
+            if (addrs.size() == 0) {
+                message("116-No wi-fi module found");
+                delete connection;
+                return NULL;
+            }
+            address = addrs.front().address();
+            fromCache = addrs.front().cached();
+            if (m_keepWarm)
+                m_defaultAddress = address;
+        }
+        if (connection->setAddress(address.c_str()) != 0) {
+            message("101-Invalid address: %s", address.c_str());
+            delete connection;
+            return NULL;
+        }
+        if (connection->checkVersion() != 0) {
+
+            /* a cached module may have moved or gone away so look for it again */
+            if (fromCache) {
+                message("Cached module %s didn't respond, rediscovering", address.c_str());
+                address.clear();
+                useCache = fromCache = false;
+                continue;
+            }
+
+            message("\
+106-Unrecognized wi-fi module firmware\n\
+    Version is %s but expected %s.\n\
+    Recommended action: update firmware and/or PropLoader to latest version(s).", connection->version(), WIFI_REQUIRED_MAJOR_VERSION);
+            m_defaultAddress.clear();
+            delete connection;
+            return NULL;
+        }
+        break;
+    }
+
+    m_wifiConnections[address] = connection;
+
+    return connection;
+}
+
+/* apply the board configuration's baud rates and reset settings to a connection */
+int LoaderCache::configure(PropConnection *connection, BoardConfig *config)
+{
+    int baudRate, delay, pulse, prequeue;
+    const char *method;
+    if (GetNumericConfigField(config, "loader-baud-rate", &baudRate))
+        connection->setLoaderBaudRate(baudRate);
+    if (GetNumericConfigField(config, "fast-loader-baud-rate", &baudRate))
+        connection->setFastLoaderBaudRate(baudRate);
+    if (GetNumericConfigField(config, "program-baud-rate", &baudRate))
+        connection->setProgramBaudRate(baudRate);
+
+    /* connections are reused by the daemon so settings that aren't given go back to their defaults */
+    if (!(method = GetConfigField(config, "reset")))
+        method = "dtr";
+    if (connection->setResetMethod(method) != 0) {
+        message("Unknown reset method '%s'", method);
+        return -1;
+    }
+    connection->setResetDelay(GetNumericConfigField(config, "reset-delay-ms", &delay) ? delay : -1);
+    connection->setResetPulse(GetNumericConfigField(config, "reset-pulse-ms", &pulse) ? pulse : -1);
+    connection->setPrequeueHandshake(GetNumericConfigField(config, "reset-prequeue", &prequeue) && prequeue != 0);
+
+    return 0;
+}
+
+/* finish with a connection for this load */
+void LoaderCache::release(PropConnection *connection, bool failed)
+{
+    connection->disconnect();
+
+    if (!m_keepWarm || !failed)
+        return;
+
+    SerialConnectionMap::iterator i = m_serialConnections.begin();
+    while (i != m_serialConnections.end()) {
+        if (i->second == connection) {
+            if (i->first == m_defaultPort)
+                m_defaultPort.clear();
+            delete i->second;
+            m_serialConnections.erase(i);
+            return;
+        }
+        ++i;
+    }
+
+    WiFiConnectionMap::iterator j = m_wifiConnections.begin();
+    while (j != m_wifiConnections.end()) {
+        if (j->second == connection) {
+            if (j->first == m_defaultAddress)
+                m_defaultAddress.clear();
+            delete j->second;
+            m_wifiConnections.erase(j);
+            return;
+        }
+        ++j;
+    }
+}
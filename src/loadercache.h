@@ -0,0 +1,35 @@
+#ifndef __LOADERCACHE_H__
+#define __LOADERCACHE_H__
+
+#include <string>
+#include <map>
+#include <list>
+#include "config.h"
+#include "serialpropconnection.h"
+#include "wifipropconnection.h"
+
+// board configurations and open connections shared by the loads run by one process
+class LoaderCache {
+public:
+    LoaderCache(bool keepWarm = false);
+    ~LoaderCache();
+    bool keepWarm() { return m_keepWarm; }
+    BoardConfig *getConfig(const char *board, const std::string &searchPath);
+    SerialPropConnection *getSerialConnection(const char *portPrefix, const char *port, const char *serialNumber = NULL);
+    WiFiPropConnection *getWiFiConnection(const char *ipaddr);
+    void release(PropConnection *connection, bool failed);
+    static int configure(PropConnection *connection, BoardConfig *config);
+private:
+    typedef std::map<std::string, BoardConfig *> ConfigMap;
+    typedef std::map<std::string, SerialPropConnection *> SerialConnectionMap;
+    typedef std::map<std::string, WiFiPropConnection *> WiFiConnectionMap;
+    bool m_keepWarm;
+    ConfigMap m_configs;
+    std::list<BoardConfig *> m_parsedConfigs;  // configurations parsed for a single load
+    SerialConnectionMap m_serialConnections;
+    WiFiConnectionMap m_wifiConnections;
+    std::string m_defaultPort;
+    std::string m_defaultAddress;
+};
+
+#endif
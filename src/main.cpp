@@ -6,15 +6,18 @@
 #include <ctype.h>
 
 #include <iostream>
+#include <chrono>
 
 #include "proploader.h"
 #include "loadelf.h"
 #include "propimage.h"
-#include "packet.h"
 #include "loader.h"
 #include "serialpropconnection.h"
 #include "wifipropconnection.h"
 #include "config.h"
+#include "sdcard.h"
+#include "loadercache.h"
+#include "daemon.h"
 
 /* port prefix */
 #if defined(CYGWIN) || defined(WIN32) || defined(MINGW)
@@ -31,12 +34,14 @@
   #define PORT_PREFIX ""
 #endif
 
-static void usage(const char *progname)
+static int usage(const char *progname)
 {
 printf("\
 PropLoader %s\n\
 \n\
 usage: %s [options] [<file>]\n\
+       %s --daemon <socket>\n\
+       %s --client <socket> [options] [<file>]\n\
 \n\
 options:\n\
     -b <type>       select target board and subtype (default is 'default:default')\n\
@@ -46,17 +51,23 @@ options:\n\
     -f <file>       write a file to the SD card\n\
     -i <ip-addr>    IP address of the Parallax Wi-Fi module\n\
     -I <path>       add a directory to the include path\n\
+    -j              display messages as JSON records\n\
     -n <name>       set the name of a Parallax Wi-Fi module\n\
     -p <port>       serial port\n\
     -P              show all serial ports\n\
     -r              run program after downloading (useful with -e)\n\
     -R              reset the Propeller\n\
     -s              do a serial download\n\
+    -S <dir|file>   write the changed files in a directory or manifest to the SD card\n\
     -t              enter terminal mode after the load is complete\n\
     -T              enter pst-compatible terminal mode after the load is complete\n\
     -v              enable verbose debugging output\n\
     -W              show all discovered wifi modules\n\
     -?              display a usage message and exit\n\
+    --capture <file> copy everything received in terminal mode to a file\n\
+    --timestamps    prefix each terminal line with the time since entering terminal mode\n\
+    --headless      capture without a console (no keyboard, exit when the target disconnects)\n\
+    --identify      reset every serial port at once and show the Propeller version on each\n\
 \n\
 file:               binary file to load (.elf or .binary)\n\
 \n\
@@ -71,47 +82,98 @@ Variables that can be set with -D are:\n\
   sdspi-do sdspi-clk sdspi-di sdspi-cs\n\
   sdspi-clr sdspi-inc sdspi-start sdspi-width spdspi-addr\n\
   sdspi-config1 sdspi-config2\n\
+  sd-window (number of SD card packets in flight, 1-4)\n\
+  reset (dtr, rts or gpio,<pin>,<level>[,<chip>] on the Raspberry Pi)\n\
+  reset-delay-ms (time to wait after reset before loading)\n\
+  reset-pulse-ms (how long to hold the Propeller in reset)\n\
+  reset-prequeue (true to send the handshake as soon as reset is released)\n\
+  usb-serial (USB serial number of the adapter to use when no port is given)\n\
 \n\
 Value expressions for -D can include:\n\
   rcfast rcslow xinput xtal1 xtal2 xtal3 pll1x pll2x pll4x pll8x pll16x k m mhz true false\n\
   an integer or two operands with a binary operator + - * / %% & | or unary + or -\n\
-  or a parenthesized expression.\n", VERSION, progname);
-    exit(1);
+  or a parenthesized expression.\n\
+\n\
+The daemon keeps board configurations and connections open between loads. Loads are submitted\n\
+with --client using the same options as a normal load except terminal mode.\n", VERSION, progname, progname, progname);
+    return 1;
 }
 
-int verbose = 0;
-int showMessageCodes = false;
-
+static int LoadMain(void *data, int argc, char *argv[]);
+static int RunCommand(LoaderCache *cache, int argc, char *argv[]);
 static void ShowPorts(const char *prefix, bool check);
+static void IdentifyPorts(const char *prefix, BoardConfig *config);
 static void ShowWiFiModules(bool check);
-static int WriteFileToSDCard(BoardConfig *config, PropConnection *connection, const char *path, const char *target);
-static int LoadSDHelper(BoardConfig *config, PropConnection *connection);
 
 int main(int argc, char *argv[])
+{
+    /* run as a daemon that keeps connections open between loads */
+    if (argc >= 2 && strcmp(argv[1], "--daemon") == 0) {
+        if (argc != 3)
+            return usage(argv[0]);
+        LoaderCache cache(true);
+        return RunDaemon(argv[2], LoadMain, &cache) == 0 ? 0 : 1;
+    }
+    
+    /* pass a load to a daemon */
+    if (argc >= 2 && strcmp(argv[1], "--client") == 0) {
+        if (argc < 3)
+            return usage(argv[0]);
+        const char *socketPath = argv[2];
+        argv[2] = argv[0];
+        int sts = RunClient(socketPath, argc - 2, &argv[2]);
+        return sts < 0 ? 1 : sts;
+    }
+    
+    LoaderCache cache;
+    return LoadMain(&cache, argc, argv);
+}
+
+static int LoadMain(void *data, int argc, char *argv[])
+{
+    int sts = RunCommand((LoaderCache *)data, argc, argv);
+    StopMessagePrinter();
+    return sts;
+}
+
+static int RunCommand(LoaderCache *cache, int argc, char *argv[])
 {
     BoardConfig *config, *configSettings;
     bool done = false;
     bool reset = false;
     bool showPorts = false;
+    bool identifyPorts = false;
     bool showModules = false;
     bool terminalMode = false;
     bool pstTerminalMode = false;
+    bool jsonMessages = false;
+    bool timestamps = false;
+    bool headless = false;
+    const char *captureFile = NULL;
     const char *board = NULL;
     const char *subtype = NULL;
     const char *ipaddr = NULL;
     const char *port = NULL;
+    char portPath[64];      /* port named by number (the daemon runs many commands so this can't be static) */
     const char *name = NULL;
     const char *file = NULL;
+    const char *syncSource = NULL;
     int loadType = ltShutdown;
     bool useSerial = false;
     bool writeFile = false;
     SerialPropConnection *serialConnection = NULL;
     WiFiPropConnection *wifiConnection = NULL;
-    PropConnection *connection;
+    PropConnection *connection = NULL;
     Loader loader;
+    std::string searchPath;
     const char *p;
     int sts, i;
     
+    /* start from the defaults since the daemon runs many loads in one process */
+    verbose = 0;
+    showMessageCodes = false;
+    xbClearPath();
+    
     /* setup a configuration to collect command line -D settings */
     configSettings = NewBoardConfig(NULL, "");
 
@@ -127,7 +189,7 @@ int main(int argc, char *argv[])
                 else if (++i < argc)
                     board = argv[i];
                 else
-                    usage(argv[0]);
+                    goto usage;
                 break;
             case 'c':   // display numeric message codes
                 showMessageCodes = true;
@@ -138,15 +200,15 @@ int main(int argc, char *argv[])
                 else if(++i < argc)
                     p = argv[i];
                 else
-                    usage(argv[0]);
+                    goto usage;
                 {
                     const char *p2;
                     char var[128];
                     if ((p2 = strchr(p, '=')) == NULL)
-                        usage(argv[0]);
+                        goto usage;
                     if (p2 - p > (int)sizeof(var) - 1) {
                         printf("error: variable name too long");
-                        return 1;
+                        goto fail;
                     }
                     strncpy(var, p, p2 - p);
                     var[p2 - p] = '\0';
@@ -162,7 +224,7 @@ int main(int argc, char *argv[])
                 else if (++i < argc)
                     file = argv[i];
                 else
-                    usage(argv[0]);
+                    goto usage;
                 writeFile = true;
                 break;
             case 'i':   // set the ip address
@@ -171,7 +233,7 @@ int main(int argc, char *argv[])
                 else if (++i < argc)
                     ipaddr = argv[i];
                 else
-                    usage(argv[0]);
+                    goto usage;
                 useSerial = false;
                 break;
             case 'I':   // add a directory to the .cfg include path
@@ -180,8 +242,13 @@ int main(int argc, char *argv[])
                 else if(++i < argc)
                     p = argv[i];
                 else
-                    usage(argv[0]);
+                    goto usage;
                 xbAddPath(p);
+                searchPath += p;
+                searchPath += '\n';
+                break;
+            case 'j':   // display messages as JSON records
+                jsonMessages = true;
                 break;
             case 'n':   // name a wifi module
                 if (argv[i][2])
@@ -189,7 +256,7 @@ int main(int argc, char *argv[])
                 else if (++i < argc)
                     name = argv[i];
                 else
-                    usage(argv[0]);
+                    goto usage;
                 done = true;
                 break;
             case 'p':   // select a serial port
@@ -198,26 +265,23 @@ int main(int argc, char *argv[])
                 else if (++i < argc)
                     port = argv[i];
                 else
-                    usage(argv[0]);
+                    goto usage;
 #if defined(CYGWIN) || defined(WIN32) || defined(LINUX)
                 if (isdigit((int)port[0])) {
 #if defined(CYGWIN) || defined(WIN32)
-                    static char buf[10];
-                    sprintf(buf, "COM%d", atoi(port));
-                    port = buf;
+                    snprintf(portPath, sizeof(portPath), "COM%d", atoi(port));
+                    port = portPath;
 #endif
 #if defined(LINUX)
-                    static char buf[64];
-                    sprintf(buf, "/dev/%s%d", PORT_PREFIX, atoi(port));
-                    port = buf;
+                    snprintf(portPath, sizeof(portPath), "/dev/%s%d", PORT_PREFIX, atoi(port));
+                    port = portPath;
 #endif
                 }
 #endif
 #if defined(MACOSX)
                 if (port[0] != '/') {
-                    static char buf[64];
-                    sprintf(buf, "/dev/%s-%s", PORT_PREFIX, port);
-                    port = buf;
+                    snprintf(portPath, sizeof(portPath), "/dev/%s-%s", PORT_PREFIX, port);
+                    port = portPath;
                 }
 #endif
                 useSerial = true;
@@ -235,6 +299,14 @@ int main(int argc, char *argv[])
             case 's':   // use the serial loader instead of the wifi loader
                 useSerial = true;
                 break;
+            case 'S':   // sync a directory or manifest to the SD card
+                if (argv[i][2])
+                    syncSource = &argv[i][2];
+                else if (++i < argc)
+                    syncSource = argv[i];
+                else
+                    goto usage;
+                break;
             case 't':   // enter terminal emulator mode after loading
                 terminalMode = true;
                 pstTerminalMode = false;
@@ -249,9 +321,30 @@ int main(int argc, char *argv[])
             case 'W':   // show wifi modules
                 showModules = true;
                 break;
+            case '-':   // long options
+                if (strcmp(argv[i], "--capture") == 0) {
+                    if (++i < argc)
+                        captureFile = argv[i];
+                    else
+                        goto usage;
+                    terminalMode = true;
+                }
+                else if (strcmp(argv[i], "--timestamps") == 0) {
+                    timestamps = true;
+                    terminalMode = true;
+                }
+                else if (strcmp(argv[i], "--headless") == 0) {
+                    headless = true;
+                    terminalMode = true;
+                }
+                else if (strcmp(argv[i], "--identify") == 0)
+                    identifyPorts = true;
+                else
+                    goto usage;
+                break;
             case '?':
             default:
-                usage(argv[0]);
+                goto usage;
                 break;
             }
         }
@@ -259,13 +352,15 @@ int main(int argc, char *argv[])
         /* remember the file to load */
         else {
             if (file)
-                usage(argv[0]);
+                goto usage;
             file = argv[i];
         }
     }
 
-    /* show ports if requested */
-    if (showPorts) {
+    /* show ports if requested (ports are identified once the board configuration is known) */
+    if (identifyPorts)
+        done = true;
+    else if (showPorts) {
         ShowPorts(PORT_PREFIX, false);
         done = true;
     }
@@ -285,8 +380,8 @@ int main(int argc, char *argv[])
 */
 
     /* finish the include path */
-    if (file)
-        xbAddFilePath(file);
+    if (file && xbAddFilePath(file))
+        searchPath.append(file, strrchr(file, DIR_SEP) - file);
     xbAddEnvironmentPath("PROPELLER_LOAD_PATH");
     xbAddProgramPath(argv);
 #if defined(LINUX) || defined(MACOSX) || defined(CYGWIN)
@@ -301,7 +396,7 @@ int main(int argc, char *argv[])
         if ((p = strchr(board, ':')) != NULL) {
             if (p - board >= (int)sizeof(boardBuffer)) {
                 printf("error: board type name too long\n");
-                return 1;
+                goto fail;
             }
             strncpy(boardBuffer, board, p - board);
             boardBuffer[p - board] = '\0';
@@ -320,114 +415,70 @@ int main(int argc, char *argv[])
     }
 
     /* setup for the selected board */
-    if (!(config = ParseConfigurationFile(board))) {
+    if (!(config = cache->getConfig(board, searchPath))) {
         printf("error: can't find board configuration '%s'\n", board);
-        return 1;
+        goto fail;
     }
     
     /* select the subtype */
     if (subtype) {
         if (!(config = GetConfigSubtype(config, subtype))) {
             printf("error: can't find board configuration subtype '%s'\n", subtype);
-            return 1;
+            goto fail;
         }
     }
     
     /* override with any command line settings */
     config = MergeConfigs(config, configSettings);
     
+    /* identify ports using the board's reset settings */
+    if (identifyPorts)
+        IdentifyPorts(PORT_PREFIX, config);
+    
     /* make sure a file to load was specified */
-    if (!done && !reset && !file && !terminalMode)
-        usage(argv[0]);
+    if (!done && !reset && !file && !syncSource && !terminalMode)
+        goto usage;
         
     /* check to see if a reset was requested or there is a file to load */
-    if (!reset && !file && !name && !terminalMode)
+    if (!reset && !file && !syncSource && !name && !terminalMode)
         goto finish;
 
     /* default to 'download and run' if neither -e nor -r are specified */
     if (loadType == ltShutdown)
         loadType = ltDownloadAndRun;
         
+    /* terminal mode needs the console so it can't be run by the daemon */
+    if (terminalMode && cache->keepWarm()) {
+        message("105-Failed to enter terminal mode");
+        goto fail;
+    }
+    
+    /* keep console output out of the transfer loops */
+    StartMessagePrinter(jsonMessages ? MESSAGE_FORMAT_JSON : MESSAGE_FORMAT_TEXT);
+    
     /* do a serial download */
     if (useSerial) {
-        SerialInfo info; // needs to stay in scope as long as we're using port
-        if (!(serialConnection = new SerialPropConnection)) {
-            message("999-Insufficient memory");
-            return 1;
-        }
-        if (!port) {
-            SerialInfoList ports;
-            if (SerialPropConnection::findPorts(PORT_PREFIX, true, ports) != 0) {
-                printf("error: serial port discovery failed\n");
-                return 1;
-            }
-            if (ports.size() == 0) {
-                printf("error: no serial ports found\n");
-                return 1;
-            }
-            info = ports.front();
-            port = info.port();
-        }
-        if ((sts = serialConnection->open(port)) != 0) {
-            printf("error: loader initialization failed: %d\n", sts);
-            return 1;
-        }
+        if (!(serialConnection = cache->getSerialConnection(PORT_PREFIX, port, GetConfigField(config, "usb-serial"))))
+            goto fail;
         connection = serialConnection;
     }
     
     /* do a wifi download */
     else {
-        if (!(wifiConnection = new WiFiPropConnection)) {
-            message("999-Insufficient memory");
-            return 1;
-        }
-        if (!ipaddr) {
-            WiFiInfoList addrs;
-            if (WiFiPropConnection::findModules(false, addrs, 1) != 0) {
-                printf("error: wifi module discovery failed\n");
-                return 1;
-            }
-            if (addrs.size() == 0) {
-                printf("error: no wifi module found\n");
-                return 1;
-            }
-            const char *ipaddr2 = addrs.front().address();
-            char *p;
-            if (!(p = (char *)malloc(strlen(ipaddr2) + 1))) {
-                message("999-Insufficient memory");
-                return 1;
-            }
-            strcpy(p, ipaddr2);
-            ipaddr = p;
-        }
-        if ((sts = wifiConnection->setAddress(ipaddr)) != 0) {
-            message("101-Invalid address: %s", ipaddr);
-            return 1;
-        }
-        if ((sts = wifiConnection->checkVersion()) != 0) {
-            message("\
-106-Unrecognized wi-fi module firmware\n\
-    Version is %s but expected %s.\n\
-    Recommended action: update firmware and/or PropLoader to latest version(s).", wifiConnection->version(), WIFI_REQUIRED_MAJOR_VERSION);
-            return 1;
-        }
+        if (!(wifiConnection = cache->getWiFiConnection(ipaddr)))
+            goto fail;
         connection = wifiConnection;
     }
     
-    /* setup the baud rates */
-    int baudRate;
-    if (GetNumericConfigField(config, "loader-baud-rate", &baudRate))
-        connection->setLoaderBaudRate(baudRate);
-    if (GetNumericConfigField(config, "fast-loader-baud-rate", &baudRate))
-        connection->setFastLoaderBaudRate(baudRate);
-    if (GetNumericConfigField(config, "program-baud-rate", &baudRate))
-        connection->setProgramBaudRate(baudRate);
+    /* setup the baud rates and reset method */
+    if (LoaderCache::configure(connection, config) != 0)
+        goto fail;
         
     /* reset the Propeller */
     if (reset) {
         if (connection->generateResetSignal() != 0) {
-            printf("error: failed to reset Propeller\n");
-            return 1;
+            message("121-Failed to reset Propeller");
+            goto fail;
         }
     }
     
@@ -435,7 +486,7 @@ int main(int argc, char *argv[])
     if (name) {
         if (!wifiConnection) {
             message("100-Option -n can only be used to name wifi modules");
-            return 1;
+            goto fail;
         }
         
 #define isAllowed(ch)   (isupper(ch) || islower(ch) || isdigit(ch) || (ch) == '-')
@@ -472,7 +523,7 @@ int main(int argc, char *argv[])
         /* if we deleted every character then this is an invalid name */
         if (!cleanName[0]) {
             message("108-Invalid module name");
-            return 1;
+            goto fail;
         }
         
         /* show the clean name if it is different from what the user requested */
@@ -481,7 +532,7 @@ int main(int argc, char *argv[])
             
         if (wifiConnection->setName(cleanName) != 0) {
             message("109-Failed to set module name");
-            return 1;
+            goto fail;
         }
     }
     
@@ -490,7 +541,16 @@ int main(int argc, char *argv[])
         message("007-Writing '%s' to the SD card", file);
         if (WriteFileToSDCard(config, connection, file, file) != 0) {
             message("107-Failed to write SD card file '%s'", file);
-            return 1;
+            goto fail;
+        }
+    }
+    
+    /* sync a directory or manifest to the SD card */
+    else if (syncSource) {
+        message("018-Syncing '%s' to the SD card", syncSource);
+        if (SyncFilesToSDCard(config, connection, syncSource) != 0) {
+            message("110-Failed to sync SD card from '%s'", syncSource);
+            goto fail;
         }
     }
     
@@ -500,7 +560,7 @@ int main(int argc, char *argv[])
         loader.setConnection(connection);
         if (file && (sts = loader.fastLoadFile(file, (LoadType)loadType)) != 0) {
             message("102-Download failed: %d", sts);
-            return 1;
+            goto fail;
         }
         message("005-Download successful!");
     }
@@ -508,33 +568,51 @@ int main(int argc, char *argv[])
     /* set the baud rate used by the program */
     if (connection->setBaudRate(connection->programBaudRate()) != 0) {
         message("999-Failed to set baud rate");
-        return 1;
+        goto fail;
     }
     
     /* enter terminal mode */
     if (terminalMode) {
         message("006-[ Entering terminal mode. Type ESC or Control-C to exit. ]");
+        FlushMessages();
         
         /* open a connection to the target */
         if (!connection->isOpen() && connection->connect() != 0) {
             message("Can't open connection to target");
             message("105-Failed to enter terminal mode");
-            return 1;
+            goto fail;
         }
         
         /* enter terminal mode */
-        if (connection->terminal(false, pstTerminalMode) != 0) {
+        TerminalOptions options;
+        options.checkForExit = false;
+        options.pstMode = pstTerminalMode;
+        options.timestamps = timestamps;
+        options.headless = headless;
+        options.captureFile = captureFile;
+        if (connection->terminal(&options) != 0) {
             message("105-Failed to enter terminal mode");
-            return 1;
+            goto fail;
         }
     }
     
     /* disconnect from the target */
-    connection->disconnect();
+    cache->release(connection, false);
     
 finish:
     /* return successfully */
+    FreeBoardConfig(configSettings);
     return 0;
+
+usage:
+    usage(argv[0]);
+
+fail:
+    /* return failure */
+    if (connection)
+        cache->release(connection, true);
+    FreeBoardConfig(configSettings);
+    return 1;
 }
 
 static void ShowPorts(const char *prefix, bool check)
@@ -549,221 +627,33 @@ static void ShowPorts(const char *prefix, bool check)
     }
 }
 
-static void ShowWiFiModules(bool show)
-{
-    WiFiInfoList modules;
-    WiFiPropConnection::findModules(true, modules);
-}
-
-#define TYPE_FILE_WRITE     0
-#define TYPE_DATA           1
-#define TYPE_EOF            2
-
-static int WriteFileToSDCard(BoardConfig *config, PropConnection *connection, const char *path, const char *target)
+static void IdentifyPorts(const char *prefix, BoardConfig *config)
 {
-    PacketDriver packetDriver(*connection);
-    uint8_t buf[PKTMAXLEN];
-    size_t size, remaining, cnt;
-    FILE *fp;
-
-    /* open the file */
-    message("001-Opening file '%s'", path);
-    if ((fp = fopen(path, "rb")) == NULL)
-        return error("103-Can't open file '%s'", path);
-
-    if (!target) {
-        if (!(target = strrchr(path, '/')))
-            target = path;
-        else
-            ++target; // skip past the slash
-    }
-
-    fseek(fp, 0, SEEK_END);
-    size = remaining = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    message("Loading SD helper");
-    if (LoadSDHelper(config, connection) != 0) {
-        fclose(fp);
-        return error("Loading SD helper");
-    }
-
-    /* wait for the SD helper to complete initialization */
-    if (!packetDriver.waitForInitialAck())
-        return error("Failed to connect to helper");
-
-    if (!packetDriver.sendPacket(TYPE_FILE_WRITE, (uint8_t *)target, strlen(target) + 1)) {
-        fclose(fp);
-        return error("SendPacket FILE_WRITE failed");
-    }
-
-    while ((cnt = fread(buf, 1, PKTMAXLEN, fp)) > 0) {
-        progress("008-%ld bytes remaining             ", (long)remaining);
-        if (!packetDriver.sendPacket(TYPE_DATA, buf, cnt)) {
-            fclose(fp);
-            return error("SendPacket DATA failed");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    SerialInfoList ports;
+    int found = 0;
+    
+    if (SerialPropConnection::findPorts(prefix, false, ports) != 0)
+        return;
+    SerialPropConnection::identifyPorts(ports, config);
+    
+    SerialInfoList::iterator i = ports.begin();
+    while (i != ports.end()) {
+        if (i->version() != 0) {
+            message("013-%s: Propeller version %d (%d ms)", i->port(), i->version(), i->identifyTime());
+            ++found;
         }
-        remaining -= cnt;
+        else
+            message("014-%s: no response (%d ms)", i->port(), i->identifyTime());
+        ++i;
     }
-    message("009-%ld bytes sent             ", (long)size);
-
-    fclose(fp);
-
-    if (!packetDriver.sendPacket(TYPE_EOF, (uint8_t *)"", 0))
-        return error("SendPacket EOF failed");
-
-    /*
-       We send two EOF packets for SD card writes.  The reason is that the EOF
-       packet does actual work, and that work takes time.  The packet
-       transmission protocol uses read-ahead buffering on the receiving end.
-       Therefore, we need to make sure the first EOF packet was received and
-       processed before resetting the Prop!
-    */
-    if (!packetDriver.sendPacket(TYPE_EOF, (uint8_t *)"", 0))
-        return error("Second SendPacket EOF failed");
-
-    return 0;
-}
-
-extern "C" {
-    extern uint8_t sd_helper_array[];
-    extern int sd_helper_size;
-}
-
-/* DAT header in sd_helper.spin */
-typedef struct {
-    uint32_t baudrate;
-    uint8_t rxpin;
-    uint8_t txpin;
-    uint8_t tvpin;
-    uint8_t dopin;
-    uint8_t clkpin;
-    uint8_t dipin;
-    uint8_t cspin;
-    uint8_t select_address;
-    uint32_t select_inc_mask;
-    uint32_t select_mask;
-} SDHelperDatHdr;
-
-static int LoadSDHelper(BoardConfig *config, PropConnection *connection)
-{
-    Loader loader(connection);
-    PropImage image(sd_helper_array, sd_helper_size);
-    SpinHdr *hdr = (SpinHdr *)image.imageData();
-    SpinObj *obj = (SpinObj *)(image.imageData() + hdr->pbase);
-    SDHelperDatHdr *dat = (SDHelperDatHdr *)((uint8_t *)obj + (obj->pubcnt + obj->objcnt) * sizeof(uint32_t));
-    int ivalue;
-
-    /* patch SD helper */
-    if (GetNumericConfigField(config, "clkfreq", &ivalue))
-        hdr->clkfreq = ivalue;
-    if (GetNumericConfigField(config, "clkmode", &ivalue))
-        hdr->clkmode = ivalue;
-    if (GetNumericConfigField(config, "baudrate", &ivalue))
-        dat->baudrate = ivalue;
-    if (GetNumericConfigField(config, "rxpin", &ivalue))
-        dat->rxpin = ivalue;
-    if (GetNumericConfigField(config, "txpin", &ivalue))
-        dat->txpin = ivalue;
-    if (GetNumericConfigField(config, "tvpin", &ivalue))
-        dat->tvpin = ivalue;
-
-    if (GetNumericConfigField(config, "sdspi-do", &ivalue))
-        dat->dopin = ivalue;
-    else
-        return error("Missing sdspi-do pin configuration");
-
-    if (GetNumericConfigField(config, "sdspi-clk", &ivalue))
-        dat->clkpin = ivalue;
-    else
-        return error("Missing sdspi-clk pin configuration");
-
-    if (GetNumericConfigField(config, "sdspi-di", &ivalue))
-        dat->dipin = ivalue;
-    else
-        return error("Missing sdspi-di pin configuration");
-
-    if (GetNumericConfigField(config, "sdspi-cs", &ivalue))
-        dat->cspin = ivalue;
-    else if (GetNumericConfigField(config, "sdspi-clr", &ivalue))
-        dat->cspin = ivalue;
-    else
-        return error("Missing sdspi-cs or sdspi-clr pin configuration");
-
-    if (GetNumericConfigField(config, "sdspi-sel", &ivalue))
-        dat->select_inc_mask = ivalue;
-    else if (GetNumericConfigField(config, "sdspi-inc", &ivalue))
-        dat->select_inc_mask = 1 << ivalue;
-
-    if (GetNumericConfigField(config, "sdspi-msk", &ivalue))
-        dat->select_mask = ivalue;
-
-    if (GetNumericConfigField(config, "sdspi-addr", &ivalue))
-        dat->select_address = (uint8_t)ivalue;
-
-    /* recompute the checksum */
-    image.updateChecksum();
-
-    /* load the SD helper program */
-    if (loader.fastLoadImage(image.imageData(), image.imageSize(), ltDownloadAndRun) != 0)
-        return error("Helper load failed");
-        
-    /* select the sd helper baud rate */
-    connection->setBaudRate(dat->baudrate);
-
-    return 0;
-}
-
-int error(const char *fmt, ...)
-{
-    va_list ap;
-    va_start(ap, fmt);
-    vmessage(fmt, ap, '\n');
-    va_end(ap);
-    return -1;
-}
-
-void message(const char *fmt, ...)
-{
-    va_list ap;
-    va_start(ap, fmt);
-    vmessage(fmt, ap, '\n');
-    va_end(ap);
-}
-
-void progress(const char *fmt, ...)
-{
-    va_list ap;
-    va_start(ap, fmt);
-    vmessage(fmt, ap, '\r');
-    va_end(ap);
+    
+    std::chrono::milliseconds elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    message("015-Found %d Propeller%s on %d port%s in %d ms", found, found == 1 ? "" : "s", (int)ports.size(), ports.size() == 1 ? "" : "s", (int)elapsed.count());
 }
 
-void vmessage(const char *fmt, va_list ap, int eol)
+static void ShowWiFiModules(bool show)
 {
-    const char *p = fmt;
-    int code = 0;
-
-    /* check for and parse the numeric message code */
-    if (*p && isdigit(*p)) {
-        while (*p && isdigit(*p))
-            code = code * 10 + *p++ - '0';
-        if (*p == '-')
-            fmt = ++p;
-    }
-
-    /* display messages in verbose mode or when the code is > 0 */
-    if (verbose || code > 0) {
-        if (showMessageCodes)
-            printf("%03d-", code);
-        if (code > 99)
-            printf("ERROR: ");
-        vprintf(fmt, ap);
-        putchar(eol);
-        if (eol == '\r')
-            fflush(stdout);
-    }
+    WiFiInfoList modules;
+    WiFiPropConnection::findModules(true, modules);
 }
-
-
-
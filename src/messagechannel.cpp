@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include "messagechannel.h"
+
+MessageChannel::MessageChannel(int format)
+    : m_format(format),
+      m_head(0),
+      m_tail(0),
+      m_sleeping(false),
+      m_flush(false),
+      m_stop(false),
+      m_havePendingProgress(false)
+{
+    m_thread = std::thread(&MessageChannel::run, this);
+}
+
+MessageChannel::~MessageChannel()
+{
+    flush();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_one();
+    m_thread.join();
+}
+
+void MessageChannel::post(int code, int eol, const char *fmt, va_list ap, long done, long total)
+{
+    std::lock_guard<std::mutex> postLock(m_post);
+    unsigned head = m_head.load(std::memory_order_relaxed);
+
+    /* when the ring is full drop progress updates and wait for room for anything else */
+    while (head - m_tail.load(std::memory_order_acquire) >= MESSAGECHANNEL_DEPTH) {
+        if (eol == '\r')
+            return;
+        m_wake.notify_one();
+        std::this_thread::yield();
+    }
+
+    MessageRecord &record = m_records[head % MESSAGECHANNEL_DEPTH];
+    record.code = code;
+    record.eol = eol;
+    record.showCode = showMessageCodes;
+    record.done = done;
+    record.total = total;
+    vsnprintf(record.text, sizeof(record.text), fmt, ap);
+    m_head.store(head + 1);
+
+    /* only pay for a wakeup when the printer is waiting */
+    if (m_sleeping.load()) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_wake.notify_one();
+    }
+}
+
+/* wait until everything posted so far has been printed */
+void MessageChannel::flush()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_flush = true;
+    m_wake.notify_one();
+    while (m_flush)
+        m_flushed.wait(lock);
+}
+
+void MessageChannel::run()
+{
+    std::chrono::steady_clock::time_point lastProgress;
+    std::chrono::milliseconds interval(MESSAGECHANNEL_PROGRESS_INTERVAL);
+
+    for (;;) {
+        unsigned tail = m_tail.load(std::memory_order_relaxed);
+
+        /* print everything that is waiting */
+        while (tail != m_head.load(std::memory_order_acquire)) {
+            const MessageRecord &record = m_records[tail % MESSAGECHANNEL_DEPTH];
+
+            /* keep only the latest progress update */
+            if (record.eol == '\r') {
+                m_pendingProgress = record;
+                m_havePendingProgress = true;
+            }
+
+            /* a message replaces any progress update that hasn't been shown */
+            else {
+                m_havePendingProgress = false;
+                print(record);
+            }
+
+            m_tail.store(++tail, std::memory_order_release);
+        }
+
+        /* show the latest progress when enough time has passed or everything must be shown */
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (m_havePendingProgress && (now - lastProgress >= interval || m_flush)) {
+            print(m_pendingProgress);
+            m_havePendingProgress = false;
+            lastProgress = now;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        /* finish a flush once the ring is empty */
+        if (m_flush && tail == m_head.load(std::memory_order_acquire) && !m_havePendingProgress) {
+            fflush(stdout);
+            m_flush = false;
+            m_flushed.notify_all();
+        }
+
+        if (m_stop)
+            break;
+
+        /* sleep until there is more to print or a pending progress update is due */
+        m_sleeping = true;
+        if (tail == m_head.load() && !m_flush) {
+            if (m_havePendingProgress)
+                m_wake.wait_for(lock, interval - (now - lastProgress));
+            else
+                m_wake.wait(lock);
+        }
+        m_sleeping = false;
+    }
+}
+
+static void PrintJSONString(const char *str)
+{
+    putchar('"');
+    for (; *str; ++str) {
+        switch (*str) {
+        case '"':
+        case '\\':
+            putchar('\\');
+            putchar(*str);
+            break;
+        case '\n':
+            fputs("\\n", stdout);
+            break;
+        default:
+            if ((unsigned char)*str < ' ')
+                printf("\\u%04x", (unsigned char)*str);
+            else
+                putchar(*str);
+            break;
+        }
+    }
+    putchar('"');
+}
+
+void MessageChannel::print(const MessageRecord &record)
+{
+    if (m_format == MESSAGE_FORMAT_JSON) {
+        printf("{\"code\": %d, \"type\": \"%s\", \"text\": ", record.code,
+               record.eol == '\r' ? "progress" : record.code > 99 ? "error" : "message");
+        PrintJSONString(record.text);
+        if (record.total >= 0)
+            printf(", \"done\": %ld, \"total\": %ld", record.done, record.total);
+        printf("}\n");
+    }
+    else {
+        if (record.showCode)
+            printf("%03d-", record.code);
+        if (record.code > 99)
+            printf("ERROR: ");
+        fputs(record.text, stdout);
+        putchar(record.eol);
+        if (record.eol == '\r')
+            fflush(stdout);
+    }
+}
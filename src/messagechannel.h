@@ -0,0 +1,63 @@
+#ifndef __MESSAGECHANNEL_H__
+#define __MESSAGECHANNEL_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "proploader.h"
+
+/* number of records that can be waiting to be printed */
+#define MESSAGECHANNEL_DEPTH        256
+
+/* longest message text kept in a record (longer messages are truncated) */
+#define MESSAGECHANNEL_TEXT_MAX     200
+
+/* minimum time between progress updates on the console (milliseconds) */
+#define MESSAGECHANNEL_PROGRESS_INTERVAL    100
+
+/* a message as it's passed from the thread producing it to the printer */
+struct MessageRecord {
+    int16_t code;
+    char eol;
+    char showCode;
+    long done;          // transfer progress counts (-1 if this isn't transfer progress)
+    long total;
+    char text[MESSAGECHANNEL_TEXT_MAX];
+};
+
+/*
+   Passes the messages from a load to a printer thread through a ring so
+   the load never waits for terminal output. Threads started by the load
+   may post too so producers take m_post, which is uncontended unless
+   they really post at the same time. Progress updates are coalesced and rendered
+   at most every MESSAGECHANNEL_PROGRESS_INTERVAL milliseconds.
+*/
+class MessageChannel {
+public:
+    MessageChannel(int format);
+    ~MessageChannel();
+    void post(int code, int eol, const char *fmt, va_list ap, long done = -1, long total = -1);
+    void flush();
+private:
+    void run();
+    void print(const MessageRecord &record);
+
+    int m_format;
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::mutex m_post;                  // serializes producers
+    std::condition_variable m_wake;     // signalled when the printer is asleep and there is work
+    std::condition_variable m_flushed;  // signalled when a flush request has been handled
+    MessageRecord m_records[MESSAGECHANNEL_DEPTH];
+    std::atomic<unsigned> m_head;       // next record to fill (written only by a producer holding m_post)
+    std::atomic<unsigned> m_tail;       // next record to print (written only by the printer)
+    std::atomic<bool> m_sleeping;
+    std::atomic<bool> m_flush;
+    bool m_stop;
+    MessageRecord m_pendingProgress;
+    bool m_havePendingProgress;
+};
+
+#endif
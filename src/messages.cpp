@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <mutex>
+#include "proploader.h"
+#include "messagechannel.h"
+
+#define MAX_MESSAGE     1024
+
+__thread int verbose = 0;
+__thread int showMessageCodes = 0;
+
+static __thread MessageHandler *messageHandler = NULL;
+static __thread void *messageHandlerData = NULL;
+static __thread MessageChannel *messageChannel = NULL;
+
+/* threads started by a load share its handler and the console so output from them is serialized */
+static std::mutex outputLock;
+
+static void vmessageEvent(const char *fmt, va_list ap, int eol, long done, long total);
+
+void SetMessageHandler(MessageHandler *handler, void *data)
+{
+    messageHandler = handler;
+    messageHandlerData = data;
+}
+
+void GetMessageContext(MessageContext *context)
+{
+    context->verbose = verbose;
+    context->showMessageCodes = showMessageCodes;
+    context->handler = messageHandler;
+    context->handlerData = messageHandlerData;
+    context->channel = messageChannel;
+}
+
+/* the thread that got the context must keep its handler and printer until this thread is done */
+void SetMessageContext(const MessageContext *context)
+{
+    verbose = context->verbose;
+    showMessageCodes = context->showMessageCodes;
+    messageHandler = context->handler;
+    messageHandlerData = context->handlerData;
+    messageChannel = (MessageChannel *)context->channel;
+}
+
+void StartMessagePrinter(int format)
+{
+    if (!messageChannel)
+        messageChannel = new MessageChannel(format);
+}
+
+void FlushMessages(void)
+{
+    if (messageChannel)
+        messageChannel->flush();
+}
+
+void StopMessagePrinter(void)
+{
+    if (messageChannel) {
+        delete messageChannel;
+        messageChannel = NULL;
+    }
+}
+
+int error(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vmessage(fmt, ap, '\n');
+    va_end(ap);
+    return -1;
+}
+
+void message(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vmessage(fmt, ap, '\n');
+    va_end(ap);
+}
+
+void progress(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vmessage(fmt, ap, '\r');
+    va_end(ap);
+}
+
+static void progressEvent(long done, long total, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vmessageEvent(fmt, ap, '\r', done, total);
+    va_end(ap);
+}
+
+/* report how far a transfer has got as message 008 with the counts for handlers */
+void progressBytes(long done, long total)
+{
+    progressEvent(done, total, "008-%ld bytes remaining             ", total - done);
+}
+
+void vmessage(const char *fmt, va_list ap, int eol)
+{
+    vmessageEvent(fmt, ap, eol, -1, -1);
+}
+
+static void vmessageEvent(const char *fmt, va_list ap, int eol, long done, long total)
+{
+    const char *p = fmt;
+    int code = 0;
+
+    /* check for and parse the numeric message code */
+    if (*p && isdigit(*p)) {
+        while (*p && isdigit(*p))
+            code = code * 10 + *p++ - '0';
+        if (*p == '-')
+            fmt = ++p;
+    }
+
+    /* pass messages to the handler in verbose mode or when the code is > 0 */
+    if (messageHandler) {
+        if (verbose || code > 0) {
+            char text[MAX_MESSAGE];
+            MessageEvent event;
+            vsnprintf(text, sizeof(text), fmt, ap);
+            event.code = code;
+            event.eol = eol;
+            event.text = text;
+            event.done = done;
+            event.total = total;
+            std::lock_guard<std::mutex> lock(outputLock);
+            (*messageHandler)(messageHandlerData, &event);
+        }
+    }
+
+    /* queue messages for the printer thread in verbose mode or when the code is > 0 */
+    else if (messageChannel) {
+        if (verbose || code > 0)
+            messageChannel->post(code, eol, fmt, ap, done, total);
+    }
+
+    /* display messages in verbose mode or when the code is > 0 */
+    else if (verbose || code > 0) {
+        std::lock_guard<std::mutex> lock(outputLock);
+        if (showMessageCodes)
+            printf("%03d-", code);
+        if (code > 99)
+            printf("ERROR: ");
+        vprintf(fmt, ap);
+        putchar(eol);
+        if (eol == '\r')
+            fflush(stdout);
+    }
+}
@@ -20,8 +20,11 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "packet.h"
+#include "crc16.h"
+#include "ioreactor.h"
 #include "proploader.h"
 
 #ifndef TRUE
@@ -31,21 +34,16 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 
 /* timeouts for waiting for ACK/NAK */
 #define INITIAL_TIMEOUT     10000   // 10 seconds
-#define PACKET_TIMEOUT      10000   // 10 seconds - this is long because SD cards may take a file to scan the FAT
+#define RETRANSMIT_TIMEOUT  1000    // resend the oldest unacknowledged packet after 1 second of silence
+#define MAX_RETRIES         10      // give up after this many resends without progress - SD cards may take a while to scan the FAT
 
-/* packet format: SOH pkt# type length-lo length-hi hdrchk length*data crc1 crc2 */
+/* packet format: SOH type seq length-hi length-lo hdrchk length*data crc1 crc2 */
 #define HDR_SOH     0
 #define HDR_TYPE    1
-#define HDR_LEN_HI  2
-#define HDR_LEN_LO  3
-#define HDR_CHK     4
-
-/* packet header and crc lengths */
-#define PKTHDRLEN   5
-#define PKTCRCLEN   2
-
-/* maximum length of a frame */
-#define FRAMELEN    (PKTHDRLEN + PKTMAXLEN + PKTCRCLEN)
+#define HDR_SEQ     2
+#define HDR_LEN_HI  3
+#define HDR_LEN_LO  4
+#define HDR_CHK     5
 
 /* protocol characters */
 #define SOH     0x01    /* start of a packet */
@@ -53,92 +51,242 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 #define NAK     0x15    /* negative acknowledgement */
 #define ESC     0x1b    /* escape from terminal mode */
 
-#define updcrc(crc, ch) (crctab[((crc) >> 8) & 0xff] ^ ((crc) << 8) ^ (ch))
-
-static const uint16_t crctab[256] = {
-    0x0000,  0x1021,  0x2042,  0x3063,  0x4084,  0x50a5,  0x60c6,  0x70e7,
-    0x8108,  0x9129,  0xa14a,  0xb16b,  0xc18c,  0xd1ad,  0xe1ce,  0xf1ef,
-    0x1231,  0x0210,  0x3273,  0x2252,  0x52b5,  0x4294,  0x72f7,  0x62d6,
-    0x9339,  0x8318,  0xb37b,  0xa35a,  0xd3bd,  0xc39c,  0xf3ff,  0xe3de,
-    0x2462,  0x3443,  0x0420,  0x1401,  0x64e6,  0x74c7,  0x44a4,  0x5485,
-    0xa56a,  0xb54b,  0x8528,  0x9509,  0xe5ee,  0xf5cf,  0xc5ac,  0xd58d,
-    0x3653,  0x2672,  0x1611,  0x0630,  0x76d7,  0x66f6,  0x5695,  0x46b4,
-    0xb75b,  0xa77a,  0x9719,  0x8738,  0xf7df,  0xe7fe,  0xd79d,  0xc7bc,
-    0x48c4,  0x58e5,  0x6886,  0x78a7,  0x0840,  0x1861,  0x2802,  0x3823,
-    0xc9cc,  0xd9ed,  0xe98e,  0xf9af,  0x8948,  0x9969,  0xa90a,  0xb92b,
-    0x5af5,  0x4ad4,  0x7ab7,  0x6a96,  0x1a71,  0x0a50,  0x3a33,  0x2a12,
-    0xdbfd,  0xcbdc,  0xfbbf,  0xeb9e,  0x9b79,  0x8b58,  0xbb3b,  0xab1a,
-    0x6ca6,  0x7c87,  0x4ce4,  0x5cc5,  0x2c22,  0x3c03,  0x0c60,  0x1c41,
-    0xedae,  0xfd8f,  0xcdec,  0xddcd,  0xad2a,  0xbd0b,  0x8d68,  0x9d49,
-    0x7e97,  0x6eb6,  0x5ed5,  0x4ef4,  0x3e13,  0x2e32,  0x1e51,  0x0e70,
-    0xff9f,  0xefbe,  0xdfdd,  0xcffc,  0xbf1b,  0xaf3a,  0x9f59,  0x8f78,
-    0x9188,  0x81a9,  0xb1ca,  0xa1eb,  0xd10c,  0xc12d,  0xf14e,  0xe16f,
-    0x1080,  0x00a1,  0x30c2,  0x20e3,  0x5004,  0x4025,  0x7046,  0x6067,
-    0x83b9,  0x9398,  0xa3fb,  0xb3da,  0xc33d,  0xd31c,  0xe37f,  0xf35e,
-    0x02b1,  0x1290,  0x22f3,  0x32d2,  0x4235,  0x5214,  0x6277,  0x7256,
-    0xb5ea,  0xa5cb,  0x95a8,  0x8589,  0xf56e,  0xe54f,  0xd52c,  0xc50d,
-    0x34e2,  0x24c3,  0x14a0,  0x0481,  0x7466,  0x6447,  0x5424,  0x4405,
-    0xa7db,  0xb7fa,  0x8799,  0x97b8,  0xe75f,  0xf77e,  0xc71d,  0xd73c,
-    0x26d3,  0x36f2,  0x0691,  0x16b0,  0x6657,  0x7676,  0x4615,  0x5634,
-    0xd94c,  0xc96d,  0xf90e,  0xe92f,  0x99c8,  0x89e9,  0xb98a,  0xa9ab,
-    0x5844,  0x4865,  0x7806,  0x6827,  0x18c0,  0x08e1,  0x3882,  0x28a3,
-    0xcb7d,  0xdb5c,  0xeb3f,  0xfb1e,  0x8bf9,  0x9bd8,  0xabbb,  0xbb9a,
-    0x4a75,  0x5a54,  0x6a37,  0x7a16,  0x0af1,  0x1ad0,  0x2ab3,  0x3a92,
-    0xfd2e,  0xed0f,  0xdd6c,  0xcd4d,  0xbdaa,  0xad8b,  0x9de8,  0x8dc9,
-    0x7c26,  0x6c07,  0x5c64,  0x4c45,  0x3ca2,  0x2c83,  0x1ce0,  0x0cc1,
-    0xef1f,  0xff3e,  0xcf5d,  0xdf7c,  0xaf9b,  0xbfba,  0x8fd9,  0x9ff8,
-    0x6e17,  0x7e36,  0x4e55,  0x5e74,  0x2e93,  0x3eb2,  0x0ed1,  0x1ef0
-};
+/* responses are ACK followed by the next sequence number the receiver expects
+   or NAK followed by the sequence number of a damaged packet */
+
+PacketDriver::PacketDriver(PropConnection &connection)
+    : m_connection(connection), m_slots(PKTMAXWINDOW), m_maxLength(0), m_base(0), m_next(0), m_count(0), m_retries(0)
+{
+    setWindow(PKTMAXWINDOW);
+    setReceiverLimits(PKTDEFLEN, PKTMAXWINDOW);
+}
 
+void PacketDriver::setWindow(int window)
+{
+    if (window < 1)
+        window = 1;
+    else if (window > m_slots)
+        window = m_slots;
+    m_window = window;
+}
+
+/* size the window slots to match what the helper can receive (only while no packets are in flight) */
+bool PacketDriver::setReceiverLimits(int maxLength, int slots)
+{
+    int i;
+
+    if (m_count > 0)
+        return false;
+
+    if (maxLength < 1)
+        maxLength = PKTDEFLEN;
+    else if (maxLength > PKTMAXLEN)
+        maxLength = PKTMAXLEN;
+    if (slots < 1)
+        slots = 1;
+    else if (slots > PKTMAXWINDOW)
+        slots = PKTMAXWINDOW;
+
+    for (i = 0; i < PKTMAXWINDOW; ++i) {
+        if (!m_frames[i].allocate(maxLength))
+            return false;
+    }
+    m_maxLength = maxLength;
+    m_slots = slots;
+    setWindow(m_window);
+
+    return true;
+}
+
+/*
+   The helper announces itself by repeating ACK and the sequence number it
+   expects until the first packet arrives, or NAK if it couldn't mount the
+   SD card. Anything it sent before we changed to its baud rate arrives as
+   noise that may happen to look like a response so only two identical
+   responses in a row are believed.
+*/
 int PacketDriver::waitForInitialAck(void)
 {
-    return waitForAckNak(INITIAL_TIMEOUT) == ACK;
+    int64_t deadline = IODeadline(INITIAL_TIMEOUT);
+    int ch, seq, lastCh = -1, lastSeq = -1, remaining;
+    
+    while ((remaining = IOTimeRemaining(deadline)) > 0) {
+        if ((ch = receiveResponse(&seq, remaining)) < 0)
+            break;
+        if (ch == lastCh && seq == lastSeq) {
+            if (ch != ACK) {
+                message("Helper couldn't mount the SD card");
+                return FALSE;
+            }
+            m_base = m_next = seq;
+            m_count = m_retries = 0;
+            return TRUE;
+        }
+        lastCh = ch;
+        lastSeq = seq;
+    }
+    
+    return FALSE;
+}
+
+int PacketDriver::sendPacket(int type, const uint8_t *buf, int len)
+{
+    return queuePacket(type, buf, len) && flush();
+}
+
+int PacketDriver::queuePacket(int type, const uint8_t *buf, int len)
+{
+    PacketFrame *frame;
+
+    /* make sure the payload fits */
+    if (len < 0 || len > m_maxLength)
+        return FALSE;
+
+    /* build the frame in its window slot */
+    if (!waitForWindow())
+        return FALSE;
+    frame = &m_frames[m_next & (PKTMAXWINDOW - 1)];
+    frame->format(type, buf, len);
+
+    return sendFrame(frame);
+}
+
+int PacketDriver::queueFrame(const PacketFrame &frame)
+{
+    PacketFrame *slot;
+
+    /* make sure the payload fits then copy the frame to its window slot */
+    if (frame.length > m_maxLength || !waitForWindow())
+        return FALSE;
+    slot = &m_frames[m_next & (PKTMAXWINDOW - 1)];
+    memcpy(slot->data, frame.data, frame.size);
+    slot->size = frame.size;
+    slot->length = frame.length;
+
+    return sendFrame(slot);
+}
+
+int PacketDriver::waitForWindow(void)
+{
+    while (m_count >= m_window) {
+        if (!processResponse())
+            return FALSE;
+    }
+    return TRUE;
 }
 
-int PacketDriver::sendPacket(int type, uint8_t *buf, int len)
+/* the frame is kept in its window slot until it is acknowledged in case it has to be sent again */
+int PacketDriver::sendFrame(PacketFrame *frame)
 {
-    uint8_t hdr[PKTHDRLEN], crc[PKTCRCLEN], *p;
-    uint16_t crc16 = 0;
-    int cnt, ch;
+    uint8_t *hdr = frame->data;
+
+    /* fill in the sequence number and fix up the header checksum */
+    hdr[HDR_SEQ] = (uint8_t)m_next;
+    hdr[HDR_CHK] = hdr[1] + hdr[2] + hdr[3] + hdr[4];
+
+    /* send the packet */
+    m_connection.sendData(frame->data, frame->size);
+    m_next = (m_next + 1) & 0xff;
+    ++m_count;
+
+    return TRUE;
+}
+
+/* make room for a payload of maxLen bytes */
+bool PacketFrame::allocate(int maxLen)
+{
+    uint8_t *newData;
+    if (maxLen <= maxLength)
+        return true;
+    if (!(newData = (uint8_t *)realloc(data, FRAMELEN(maxLen))))
+        return false;
+    data = newData;
+    maxLength = maxLen;
+    return true;
+}
+
+void PacketFrame::format(int type, const uint8_t *buf, int len)
+{
+    uint8_t *hdr = data, *crc = &data[PKTHDRLEN + len];
+    uint16_t crc16;
 
     /* setup the frame header */
     hdr[HDR_SOH] = SOH;                                 /* SOH */
-    hdr[HDR_TYPE] = type;                               /* type type */
+    hdr[HDR_TYPE] = type;                               /* packet type */
+    hdr[HDR_SEQ] = 0;                                   /* sequence number */
     hdr[HDR_LEN_HI] = (uint8_t)(len >> 8);              /* data length - high byte */
     hdr[HDR_LEN_LO] = (uint8_t)len;                     /* data length - low byte */
-    hdr[HDR_CHK] = hdr[1] + hdr[2] + hdr[3];            /* header checksum */
-
-    /* compute the crc */
-    for (p = buf, cnt = len; --cnt >= 0; ++p)
-        crc16 = updcrc(crc16, *p);
-    crc16 = updcrc(crc16, '\0');
-    crc16 = updcrc(crc16, '\0');
+    hdr[HDR_CHK] = hdr[1] + hdr[2] + hdr[3] + hdr[4];   /* header checksum */
 
-    /* add the crc to the frame */
+    /* add the payload and its crc */
+    if (len > 0 && buf != &hdr[PKTHDRLEN])
+        memcpy(&hdr[PKTHDRLEN], buf, len);
+    crc16 = CRC16(&hdr[PKTHDRLEN], len);
     crc[0] = (uint8_t)(crc16 >> 8);
     crc[1] = (uint8_t)crc16;
 
-    /* send the packet */
-    m_connection.sendData(hdr, PKTHDRLEN);
-    if (len > 0)
-        m_connection.sendData(buf, len);
-    m_connection.sendData(crc, PKTCRCLEN);
-
-    /* wait for an ACK/NAK */
-    if ((ch = waitForAckNak(PACKET_TIMEOUT)) < 0) {
-        message("Timeout waiting for ACK/NAK");
-        ch = NAK;
+    size = PKTHDRLEN + len + PKTCRCLEN;
+    length = len;
+}
+
+int PacketDriver::flush(void)
+{
+    while (m_count > 0) {
+        if (!processResponse())
+            return FALSE;
     }
+    return TRUE;
+}
 
-    /* return status */
-    return ch == ACK;
+int PacketDriver::processResponse(void)
+{
+    int ch, seq, acked;
+
+    /* resend the oldest packet if the receiver has gone quiet */
+    if ((ch = receiveResponse(&seq, RETRANSMIT_TIMEOUT)) < 0) {
+        if (++m_retries > MAX_RETRIES) {
+            message("Timeout waiting for ACK/NAK");
+            return FALSE;
+        }
+        resendFrame(m_base);
+        return TRUE;
+    }
+
+    /* an ACK acknowledges every packet before seq */
+    if (ch == ACK) {
+        acked = (seq - m_base) & 0xff;
+        if (acked > 0 && acked <= m_count) {
+            m_base = seq;
+            m_count -= acked;
+            m_retries = 0;
+        }
+    }
+
+    /* a NAK asks for a damaged packet to be sent again */
+    else {
+        if (++m_retries > MAX_RETRIES) {
+            message("Too many NAKs");
+            return FALSE;
+        }
+        if (((seq - m_base) & 0xff) >= m_count)
+            seq = m_base; // damaged header so we don't know which packet it was
+        resendFrame(seq);
+    }
+
+    return TRUE;
+}
+
+void PacketDriver::resendFrame(int seq)
+{
+    PacketFrame *frame = &m_frames[seq & (PKTMAXWINDOW - 1)];
+    m_connection.sendData(frame->data, frame->size);
 }
 
 int PacketDriver::receivePacket(int *pType, uint8_t *buf, int len, int timeout)
 {
     uint8_t hdr[PKTHDRLEN], crc[PKTCRCLEN];
     int actual_len, chk;
-    uint16_t crc16 = 0;
+    uint16_t crc16;
 
     /* look for start of packet */
     do {
@@ -151,7 +299,7 @@ int PacketDriver::receivePacket(int *pType, uint8_t *buf, int len, int timeout)
         return -1;
 
     /* check the header checksum */
-    chk = (hdr[1] + hdr[2] + hdr[3]) & 0xff;
+    chk = (hdr[1] + hdr[2] + hdr[3] + hdr[4]) & 0xff;
     if (hdr[HDR_CHK] != chk)
         return -1;
 
@@ -165,16 +313,14 @@ int PacketDriver::receivePacket(int *pType, uint8_t *buf, int len, int timeout)
         return -1;
 
     /* compute the crc */
-    for (len = actual_len; --len >= 0; )
-        crc16 = updcrc(crc16, *buf++);
+    crc16 = CRC16(buf, actual_len);
 
     /* receive the crc */
     if (m_connection.receiveDataExactTimeout(crc, PKTCRCLEN, timeout) == -1)
         return-1;
 
     /* check the crc */
-    crc16 = updcrc(crc16, crc[0]);
-    crc16 = updcrc(crc16, crc[1]);
+    crc16 = UpdateCRC16(crc16, crc, PKTCRCLEN);
     if (crc16 != 0)
         return -1;
 
@@ -183,8 +329,22 @@ int PacketDriver::receivePacket(int *pType, uint8_t *buf, int len, int timeout)
     return actual_len;
 }
 
-int PacketDriver::waitForAckNak(int timeout)
+int PacketDriver::receiveResponse(int *pSeq, int timeout)
 {
     uint8_t buf[1];
-    return m_connection.receiveDataExactTimeout(buf, 1, timeout) == 1 ? buf[0] : -1;
+    int ch;
+
+    /* skip anything that isn't the start of a response */
+    do {
+        if (m_connection.receiveDataExactTimeout(buf, 1, timeout) != 1)
+            return -1;
+        ch = buf[0];
+    } while (ch != ACK && ch != NAK);
+
+    /* get the sequence number */
+    if (m_connection.receiveDataExactTimeout(buf, 1, timeout) != 1)
+        return -1;
+    *pSeq = buf[0];
+
+    return ch;
 }
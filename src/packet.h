@@ -24,18 +24,65 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 
 #include "propconnection.h"
 
-#define PKTMAXLEN   1024
+/* largest payload the host will send (the helper announces what it can take at the start of a session) */
+#define PKTMAXLEN   8192
+
+/* payload size to use until the helper says otherwise */
+#define PKTDEFLEN   1024
+
+/* maximum number of unacknowledged packets (power of 2, at most the number of receive slots in packet_driver.spin) */
+#define PKTMAXWINDOW    4
+
+/* packet header and crc lengths */
+#define PKTHDRLEN   6
+#define PKTCRCLEN   2
+
+/* length of a frame with a payload of len bytes */
+#define FRAMELEN(len)   (PKTHDRLEN + (len) + PKTCRCLEN)
+
+/* a complete frame ready to send (the sequence number is filled in when it is queued) */
+struct PacketFrame {
+    PacketFrame() : size(0), length(0), maxLength(0), data(NULL) {}
+    ~PacketFrame() { if (data) free(data); }
+    bool allocate(int maxLen);
+    void format(int type, const uint8_t *buf, int len);
+    int size;           // size of the frame
+    int length;         // length of the payload
+    int maxLength;      // largest payload that fits in data
+    uint8_t *data;
+private:
+    PacketFrame(const PacketFrame &);
+    PacketFrame &operator=(const PacketFrame &);
+};
 
 class PacketDriver {
 public:
-    PacketDriver(PropConnection &connection) : m_connection(connection) {}
+    PacketDriver(PropConnection &connection);
+    void setWindow(int window);
+    bool setReceiverLimits(int maxLength, int slots);
+    int maxLength() { return m_maxLength; }
     int waitForInitialAck(void);
-    int sendPacket(int type, uint8_t *buf, int len);
+    int sendPacket(int type, const uint8_t *buf, int len);
+    int queuePacket(int type, const uint8_t *buf, int len);
+    int queueFrame(const PacketFrame &frame);
+    int flush(void);
     int receivePacket(int *pType, uint8_t *buf, int len, int timeout);
 private:
-    int waitForAckNak(int timeout);
+    int waitForWindow(void);
+    int sendFrame(PacketFrame *frame);
+    int processResponse(void);
+    int receiveResponse(int *pSeq, int timeout);
+    void resendFrame(int seq);
 
     PropConnection &m_connection;
+    int m_window;       // number of packets that may be in flight
+    int m_slots;        // number of receive slots in the helper
+    int m_maxLength;    // largest payload the helper can receive
+    int m_base;         // sequence number of the oldest unacknowledged packet
+    int m_next;         // sequence number of the next packet to send
+    int m_count;        // number of unacknowledged packets
+    int m_retries;      // retransmissions since the window last moved
+    PacketFrame m_frames[PKTMAXWINDOW];
 };
 
 
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include "terminal.h"
 
 typedef enum {
     ltShutdown = 0,
@@ -16,7 +17,7 @@ class PropConnection
 {
 public:
     PropConnection() : m_portName(NULL) {}
-    ~PropConnection() { if (m_portName) free(m_portName); }
+    virtual ~PropConnection() { if (m_portName) free(m_portName); }
     virtual bool isOpen() = 0;
     virtual int close() = 0;
     virtual int connect() = 0;
@@ -30,7 +31,16 @@ public:
     virtual int receiveDataExactTimeout(uint8_t *buf, int len, int timeout) = 0;
     virtual int setBaudRate(int baudRate) = 0;
     virtual int maxDataSize() = 0;
-    virtual int terminal(bool checkForExit, bool pstMode) = 0;
+    virtual int terminal(const TerminalOptions *options) = 0;
+    // start whatever a load needs from the target (the reset) in the background so the image
+    // can be prepared at the same time; loadImage waits for it and cancelLoad abandons it
+    virtual int startLoad() { return 0; }
+    virtual void cancelLoad() {}
+    // connections that can't choose how the Propeller is reset ignore these
+    virtual int setResetMethod(const char *method) { return 0; }
+    virtual void setResetDelay(int delay) {}
+    virtual void setResetPulse(int pulse) {}
+    virtual void setPrequeueHandshake(bool prequeue) {}
     const char *portName() { return m_portName ? m_portName : "<none>"; }
     void setPortName(const char *portName) {
         if (m_portName)
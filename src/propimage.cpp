@@ -98,8 +98,7 @@ int PropImage::load(const char *file)
 
     /* open the binary */
     if (!(fp = fopen(file, "rb"))) {
-        if (verbose)
-            printf("error: can't open '%s'\n", file);
+        message("Can't open '%s'", file);
         return -1;
     }
 
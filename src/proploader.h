@@ -7,11 +7,49 @@
 extern "C" {
 #endif
 
-extern int verbose;
+/* message settings are per thread so loads on different threads don't interfere */
+extern __thread int verbose;
+extern __thread int showMessageCodes;
+
+/* a message or progress update */
+typedef struct {
+    int code;           /* numeric message code (0 for debugging output, > 99 for errors) */
+    int eol;            /* '\n' for a message or '\r' for a progress update */
+    const char *text;   /* message text without the code or end of line */
+    long done;          /* bytes transferred so far for a transfer progress update (-1 otherwise) */
+    long total;         /* total bytes to transfer (-1 if this isn't a transfer progress update) */
+} MessageEvent;
+
+typedef void MessageHandler(void *data, const MessageEvent *event);
+
+/* send this thread's messages to a handler instead of stdout (NULL restores stdout) */
+void SetMessageHandler(MessageHandler *handler, void *data);
+
+/* a thread's message settings so the threads it starts can report to the same place */
+typedef struct {
+    int verbose;
+    int showMessageCodes;
+    MessageHandler *handler;
+    void *handlerData;
+    void *channel;
+} MessageContext;
+
+void GetMessageContext(MessageContext *context);
+void SetMessageContext(const MessageContext *context);
+
+/* message formats used by the printer thread */
+#define MESSAGE_FORMAT_TEXT     0
+#define MESSAGE_FORMAT_JSON     1
+
+/* print this thread's messages from a separate thread so the caller never waits for the console */
+void StartMessagePrinter(int format);
+void FlushMessages(void);
+void StopMessagePrinter(void);
 
 int error(const char *fmt, ...);
 void message(const char *fmt, ...);
 void progress(const char *fmt, ...);
+void progressBytes(long done, long total);
 void vmessage(const char *fmt, va_list ap, int eol);
 
 #ifdef __cplusplus
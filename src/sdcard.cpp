@@ -0,0 +1,536 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include <string>
+#include <list>
+
+#include "proploader.h"
+#include "propimage.h"
+#include "packet.h"
+#include "framereader.h"
+#include "loader.h"
+#include "sdcard.h"
+
+/* packet types */
+#define TYPE_FILE_WRITE     0
+#define TYPE_DATA           1
+#define TYPE_EOF            2
+#define TYPE_FILE_INFO      3
+#define TYPE_SESSION        4
+#define TYPE_FILE_MAP       5
+#define TYPE_BLOCK_SEEK     6
+#define TYPE_BLOCK_DATA     7
+
+/* size of an SD card block */
+#define SD_BLOCK_SIZE       512
+
+/* files at least this big are written straight to their blocks when they can be */
+#define BLOCK_WRITE_MIN     (64 * 1024)
+
+/* maximum length of an 8.3 file name including the terminator */
+#define SD_NAME_MAX         13
+
+/* FILE_INFO reply: size (-1 if the file doesn't exist) and two running sums, all little-endian */
+#define FILE_INFO_REPLY_LEN 12
+
+/* the helper hashes at least this many bytes per millisecond */
+#define HASH_BYTES_PER_MS   16
+#define FILE_INFO_TIMEOUT   10000
+
+/* FILE_MAP reply: first block of the file or -1 if it has to be written through the file system */
+#define FILE_MAP_REPLY_LEN  4
+#define FILE_MAP_TIMEOUT    10000
+
+/* EOF reply after a block write: the first write error or 0, little-endian */
+#define BLOCK_EOF_REPLY_LEN 4
+#define BLOCK_EOF_TIMEOUT   1000
+
+/* SESSION reply: size of the helper's receive slots and the number of slots, both little-endian */
+#define SESSION_REPLY_LEN   8
+#define SESSION_TIMEOUT     1000
+
+/* a file to be written to the SD card */
+class SyncFile {
+public:
+    SyncFile(const std::string &path, const std::string &target) : m_path(path), m_target(target) {}
+    const char *path() { return m_path.c_str(); }
+    const char *target() { return m_target.c_str(); }
+private:
+    std::string m_path;
+    std::string m_target;
+};
+
+typedef std::list<SyncFile> SyncFileList;
+
+extern "C" {
+    extern uint8_t sd_helper_array[];
+    extern int sd_helper_size;
+}
+
+/* DAT header in sd_helper.spin */
+typedef struct {
+    uint32_t baudrate;
+    uint8_t rxpin;
+    uint8_t txpin;
+    uint8_t tvpin;
+    uint8_t dopin;
+    uint8_t clkpin;
+    uint8_t dipin;
+    uint8_t cspin;
+    uint8_t select_address;
+    uint32_t select_inc_mask;
+    uint32_t select_mask;
+} SDHelperDatHdr;
+
+static int StartSDHelper(BoardConfig *config, PropConnection *connection, PacketDriver &packetDriver);
+static int LoadSDHelper(BoardConfig *config, PropConnection *connection);
+static int QueueFile(PacketDriver &packetDriver, FILE *fp, const char *target);
+static int QueueBlocks(PacketDriver &packetDriver, FILE *fp, uint32_t block, size_t size);
+static int GetFileBlock(PacketDriver &packetDriver, const char *target, uint32_t size, uint32_t *pBlock);
+static int MakeFileRequest(uint8_t *request, uint32_t size, const char *target);
+static int FileIsUnchanged(PacketDriver &packetDriver, FILE *fp, const char *target);
+static int GetSyncFiles(const char *source, SyncFileList &files);
+static uint32_t GetLong(const uint8_t *p);
+static const char *BaseName(const char *path);
+
+int WriteFileToSDCard(BoardConfig *config, PropConnection *connection, const char *path, const char *target)
+{
+    PacketDriver packetDriver(*connection);
+    FILE *fp;
+
+    /* open the file */
+    message("001-Opening file '%s'", path);
+    if ((fp = fopen(path, "rb")) == NULL)
+        return error("103-Can't open file '%s'", path);
+
+    if (!target)
+        target = BaseName(path);
+
+    if (StartSDHelper(config, connection, packetDriver) != 0) {
+        fclose(fp);
+        return -1;
+    }
+
+    if (QueueFile(packetDriver, fp, target) != 0) {
+        fclose(fp);
+        return -1;
+    }
+
+    fclose(fp);
+
+    /*
+       The helper only acknowledges a packet after it has finished processing
+       it so once the EOF packet is acknowledged the file has been closed and
+       it is safe to reset the Prop.
+    */
+    if (!packetDriver.flush())
+        return error("SendPacket EOF failed");
+
+    return 0;
+}
+
+int SyncFilesToSDCard(BoardConfig *config, PropConnection *connection, const char *source)
+{
+    PacketDriver packetDriver(*connection);
+    int written = 0, unchanged = 0;
+    SyncFileList files;
+    FILE *fp;
+
+    /* get the list of files to sync */
+    if (GetSyncFiles(source, files) != 0)
+        return -1;
+
+    if (StartSDHelper(config, connection, packetDriver) != 0)
+        return -1;
+
+    /* write each file that doesn't already match the copy on the card */
+    SyncFileList::iterator i = files.begin();
+    while (i != files.end()) {
+        if ((fp = fopen(i->path(), "rb")) == NULL)
+            return error("103-Can't open file '%s'", i->path());
+        if (FileIsUnchanged(packetDriver, fp, i->target())) {
+            message("011-Skipping '%s' (unchanged)", i->path());
+            ++unchanged;
+        }
+        else {
+            message("017-Writing '%s' to the SD card as '%s'", i->path(), i->target());
+            if (QueueFile(packetDriver, fp, i->target()) != 0) {
+                fclose(fp);
+                return -1;
+            }
+            ++written;
+        }
+        fclose(fp);
+        ++i;
+    }
+
+    /* wait for the last file to be closed */
+    if (!packetDriver.flush())
+        return error("SendPacket EOF failed");
+
+    message("012-%d files written, %d unchanged", written, unchanged);
+
+    return 0;
+}
+
+static int StartSDHelper(BoardConfig *config, PropConnection *connection, PacketDriver &packetDriver)
+{
+    uint8_t reply[SESSION_REPLY_LEN];
+    int window, len, type;
+
+    /* number of packets to keep in flight */
+    if (GetNumericConfigField(config, "sd-window", &window))
+        packetDriver.setWindow(window);
+
+    message("Loading SD helper");
+    if (LoadSDHelper(config, connection) != 0)
+        return error("Loading SD helper");
+
+    /* wait for the SD helper to complete initialization */
+    if (!packetDriver.waitForInitialAck())
+        return error("Failed to connect to helper");
+
+    /* use the largest packets the helper can take */
+    if (!packetDriver.sendPacket(TYPE_SESSION, NULL, 0))
+        return error("SendPacket SESSION failed");
+    if ((len = packetDriver.receivePacket(&type, reply, sizeof(reply), SESSION_TIMEOUT)) < 0
+    ||  type != TYPE_SESSION || len != SESSION_REPLY_LEN)
+        message("No SESSION reply, using %d byte packets", packetDriver.maxLength());
+    else if (!packetDriver.setReceiverLimits(GetLong(&reply[0]), GetLong(&reply[4])))
+        return error("Insufficient memory for packet buffers");
+    else
+        message("Helper takes %d byte packets", packetDriver.maxLength());
+
+    return 0;
+}
+
+/* queue the packets to write a file without waiting for the last of them to be acknowledged */
+static int QueueFile(PacketDriver &packetDriver, FILE *fp, const char *target)
+{
+    size_t size, remaining;
+    PacketFrame *frame;
+
+    uint32_t block;
+
+    fseek(fp, 0, SEEK_END);
+    size = remaining = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    /* overwrite a large file in place if it is already on the card with the same size */
+    if (size >= BLOCK_WRITE_MIN && GetFileBlock(packetDriver, target, size, &block))
+        return QueueBlocks(packetDriver, fp, block, size);
+
+    if (!packetDriver.queuePacket(TYPE_FILE_WRITE, (uint8_t *)target, strlen(target) + 1))
+        return error("SendPacket FILE_WRITE failed");
+
+    /* the reader prepares the DATA frames while we wait for acknowledgements */
+    {
+        FrameReader reader(fp, TYPE_DATA, packetDriver.maxLength());
+        while ((frame = reader.nextFrame()) != NULL) {
+            progressBytes((long)(size - remaining), (long)size);
+            if (!packetDriver.queueFrame(*frame))
+                return error("SendPacket DATA failed");
+            remaining -= frame->length;
+            reader.releaseFrame();
+        }
+        if (reader.readError())
+            return error("Reading file failed");
+    }
+
+    if (!packetDriver.queuePacket(TYPE_EOF, (uint8_t *)"", 0))
+        return error("SendPacket EOF failed");
+    message("009-%ld bytes sent             ", (long)size);
+
+    return 0;
+}
+
+/*
+   A file that is already on the card with the same size and stored in
+   consecutive clusters can be replaced by writing its blocks directly,
+   which skips the FAT layer in the helper entirely. The helper tells us
+   the first block and the rest follow from the file size. Deploying a
+   large image to an existing file of the same size (or padding images
+   to a fixed size) makes every update after the first one take this
+   path. The directory entry isn't touched so the file keeps its date.
+   Block writes aren't acknowledged individually so the helper replies
+   to the closing EOF with the first error it saw.
+*/
+static int QueueBlocks(PacketDriver &packetDriver, FILE *fp, uint32_t block, size_t size)
+{
+    size_t remaining = size;
+    uint8_t request[4], reply[BLOCK_EOF_REPLY_LEN];
+    PacketFrame *frame;
+    int maxLength, len, type;
+    int32_t status;
+
+    message("Writing %ld blocks starting at block %lu", (long)((size + SD_BLOCK_SIZE - 1) / SD_BLOCK_SIZE), (unsigned long)block);
+
+    request[0] = (uint8_t)block;
+    request[1] = (uint8_t)(block >> 8);
+    request[2] = (uint8_t)(block >> 16);
+    request[3] = (uint8_t)(block >> 24);
+    if (!packetDriver.queuePacket(TYPE_BLOCK_SEEK, request, sizeof(request)))
+        return error("SendPacket BLOCK_SEEK failed");
+
+    /* each packet carries whole blocks with the last one padded with zeros */
+    maxLength = packetDriver.maxLength() - packetDriver.maxLength() % SD_BLOCK_SIZE;
+    {
+        FrameReader reader(fp, TYPE_BLOCK_DATA, maxLength, SD_BLOCK_SIZE);
+        while ((frame = reader.nextFrame()) != NULL) {
+            progressBytes((long)(size - remaining), (long)size);
+            if (!packetDriver.queueFrame(*frame))
+                return error("SendPacket BLOCK_DATA failed");
+            remaining -= remaining < (size_t)frame->length ? remaining : frame->length;
+            reader.releaseFrame();
+        }
+        if (reader.readError())
+            return error("Reading file failed");
+    }
+
+    /* wait for the helper to finish writing and tell us how it went */
+    if (!packetDriver.sendPacket(TYPE_EOF, (uint8_t *)"", 0))
+        return error("SendPacket EOF failed");
+    if ((len = packetDriver.receivePacket(&type, reply, sizeof(reply), BLOCK_EOF_TIMEOUT)) < 0
+    ||  type != TYPE_EOF || len != BLOCK_EOF_REPLY_LEN)
+        return error("No EOF reply from helper");
+    if ((status = (int32_t)GetLong(&reply[0])) != 0)
+        return error("Writing blocks failed: %d", status);
+    message("009-%ld bytes sent             ", (long)size);
+
+    return 0;
+}
+
+/* ask the helper where a file of the same size is stored (returns false if it has to be written through the file system) */
+static int GetFileBlock(PacketDriver &packetDriver, const char *target, uint32_t size, uint32_t *pBlock)
+{
+    uint8_t request[4 + SD_NAME_MAX], reply[FILE_MAP_REPLY_LEN];
+    int len, type;
+
+    /* a helper that can't take whole blocks in a packet can only write through the file system */
+    if (packetDriver.maxLength() < SD_BLOCK_SIZE)
+        return false;
+
+    len = MakeFileRequest(request, size, target);
+    if (!packetDriver.sendPacket(TYPE_FILE_MAP, request, len))
+        return false;
+
+    if ((len = packetDriver.receivePacket(&type, reply, sizeof(reply), FILE_MAP_TIMEOUT)) < 0) {
+        message("Timeout waiting for FILE_MAP reply");
+        return false;
+    }
+    if (type != TYPE_FILE_MAP || len != FILE_MAP_REPLY_LEN || GetLong(&reply[0]) == 0xffffffff)
+        return false;
+
+    *pBlock = GetLong(&reply[0]);
+    return true;
+}
+
+/* build a FILE_INFO or FILE_MAP request: the file size followed by its 8.3 name */
+static int MakeFileRequest(uint8_t *request, uint32_t size, const char *target)
+{
+    request[0] = (uint8_t)size;
+    request[1] = (uint8_t)(size >> 8);
+    request[2] = (uint8_t)(size >> 16);
+    request[3] = (uint8_t)(size >> 24);
+    strncpy((char *)&request[4], target, SD_NAME_MAX - 1);
+    request[4 + SD_NAME_MAX - 1] = '\0';
+    return 4 + strlen((char *)&request[4]) + 1;
+}
+
+static uint32_t GetLong(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* ask the helper whether the card already holds an identical copy of the file */
+static int FileIsUnchanged(PacketDriver &packetDriver, FILE *fp, const char *target)
+{
+    uint8_t request[4 + SD_NAME_MAX], reply[FILE_INFO_REPLY_LEN], buf[PKTDEFLEN];
+    uint32_t size, sum1 = 0, sum2 = 0;
+    int len, type, cnt, i;
+
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    /* the helper only hashes the file if its size matches */
+    len = MakeFileRequest(request, size, target);
+    if (!packetDriver.sendPacket(TYPE_FILE_INFO, request, len))
+        return false;
+
+    /* a missing or garbled reply just means the file gets written */
+    if ((len = packetDriver.receivePacket(&type, reply, sizeof(reply), FILE_INFO_TIMEOUT + size / HASH_BYTES_PER_MS)) < 0) {
+        message("Timeout waiting for FILE_INFO reply");
+        return false;
+    }
+    if (type != TYPE_FILE_INFO || len != FILE_INFO_REPLY_LEN || GetLong(&reply[0]) != size)
+        return false;
+
+    /* compute the same running sums the helper uses */
+    while ((cnt = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        for (i = 0; i < cnt; ++i) {
+            sum1 += buf[i];
+            sum2 += sum1;
+        }
+    }
+    fseek(fp, 0, SEEK_SET);
+
+    return GetLong(&reply[4]) == sum1 && GetLong(&reply[8]) == sum2;
+}
+
+/* check that a name will fit in the SD card root directory */
+static bool IsShortName(const char *name)
+{
+    const char *dot = strchr(name, '.');
+    int baseLen = dot ? (int)(dot - name) : (int)strlen(name);
+    return baseLen > 0 && baseLen <= 8 && (!dot || (strlen(dot + 1) <= 3 && !strchr(dot + 1, '.')));
+}
+
+/* add a file named in a manifest to the sync list */
+static int AddSyncFile(SyncFileList &files, const std::string &path, const char *target)
+{
+    if (!IsShortName(target))
+        return error("104-'%s' is not a valid 8.3 file name", target);
+    files.push_back(SyncFile(path, target));
+    return 0;
+}
+
+/*
+   A sync source is either a directory whose regular files are all written
+   or a manifest with one file per line in the form "<path> [<target>]".
+   Files in a directory that don't have 8.3 names (.gitignore and the like)
+   are skipped but a manifest entry that doesn't is an error.
+   Relative manifest paths are relative to the manifest's directory. Blank
+   lines and lines beginning with '#' are ignored.
+*/
+static int GetSyncFiles(const char *source, SyncFileList &files)
+{
+    struct stat st;
+
+    if (stat(source, &st) != 0)
+        return error("103-Can't open file '%s'", source);
+
+    /* write every regular file in a directory */
+    if (S_ISDIR(st.st_mode)) {
+        struct dirent *entry;
+        DIR *dir;
+        if (!(dir = opendir(source)))
+            return error("103-Can't open file '%s'", source);
+        while ((entry = readdir(dir)) != NULL) {
+            std::string path = std::string(source) + "/" + entry->d_name;
+            if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+                continue;
+            if (!IsShortName(entry->d_name)) {
+                message("Skipping '%s': not an 8.3 name", path.c_str());
+                continue;
+            }
+            files.push_back(SyncFile(path, entry->d_name));
+        }
+        closedir(dir);
+    }
+
+    /* write the files listed in a manifest */
+    else {
+        std::string dir(source, BaseName(source) - source);
+        char line[1024], *path, *target;
+        FILE *fp;
+        if (!(fp = fopen(source, "r")))
+            return error("103-Can't open file '%s'", source);
+        while (fgets(line, sizeof(line), fp)) {
+            if (!(path = strtok(line, " \t\r\n")) || *path == '#')
+                continue;
+            if (!(target = strtok(NULL, " \t\r\n")))
+                target = (char *)BaseName(path);
+            if (AddSyncFile(files, *path == '/' ? std::string(path) : dir + path, target) != 0) {
+                fclose(fp);
+                return -1;
+            }
+        }
+        fclose(fp);
+    }
+
+    if (files.size() == 0)
+        return error("No files to write from '%s'", source);
+
+    return 0;
+}
+
+static const char *BaseName(const char *path)
+{
+    const char *p;
+    if (!(p = strrchr(path, '/')))
+        return path;
+    return p + 1; // skip past the slash
+}
+
+static int LoadSDHelper(BoardConfig *config, PropConnection *connection)
+{
+    Loader loader(connection);
+    PropImage image(sd_helper_array, sd_helper_size);
+    SpinHdr *hdr = (SpinHdr *)image.imageData();
+    SpinObj *obj = (SpinObj *)(image.imageData() + hdr->pbase);
+    SDHelperDatHdr *dat = (SDHelperDatHdr *)((uint8_t *)obj + (obj->pubcnt + obj->objcnt) * sizeof(uint32_t));
+    int ivalue;
+
+    /* patch SD helper */
+    if (GetNumericConfigField(config, "clkfreq", &ivalue))
+        hdr->clkfreq = ivalue;
+    if (GetNumericConfigField(config, "clkmode", &ivalue))
+        hdr->clkmode = ivalue;
+    if (GetNumericConfigField(config, "baudrate", &ivalue))
+        dat->baudrate = ivalue;
+    if (GetNumericConfigField(config, "rxpin", &ivalue))
+        dat->rxpin = ivalue;
+    if (GetNumericConfigField(config, "txpin", &ivalue))
+        dat->txpin = ivalue;
+    if (GetNumericConfigField(config, "tvpin", &ivalue))
+        dat->tvpin = ivalue;
+
+    if (GetNumericConfigField(config, "sdspi-do", &ivalue))
+        dat->dopin = ivalue;
+    else
+        return error("Missing sdspi-do pin configuration");
+
+    if (GetNumericConfigField(config, "sdspi-clk", &ivalue))
+        dat->clkpin = ivalue;
+    else
+        return error("Missing sdspi-clk pin configuration");
+
+    if (GetNumericConfigField(config, "sdspi-di", &ivalue))
+        dat->dipin = ivalue;
+    else
+        return error("Missing sdspi-di pin configuration");
+
+    if (GetNumericConfigField(config, "sdspi-cs", &ivalue))
+        dat->cspin = ivalue;
+    else if (GetNumericConfigField(config, "sdspi-clr", &ivalue))
+        dat->cspin = ivalue;
+    else
+        return error("Missing sdspi-cs or sdspi-clr pin configuration");
+
+    if (GetNumericConfigField(config, "sdspi-sel", &ivalue))
+        dat->select_inc_mask = ivalue;
+    else if (GetNumericConfigField(config, "sdspi-inc", &ivalue))
+        dat->select_inc_mask = 1 << ivalue;
+
+    if (GetNumericConfigField(config, "sdspi-msk", &ivalue))
+        dat->select_mask = ivalue;
+
+    if (GetNumericConfigField(config, "sdspi-addr", &ivalue))
+        dat->select_address = (uint8_t)ivalue;
+
+    /* recompute the checksum */
+    image.updateChecksum();
+
+    /* load the SD helper program */
+    if (loader.fastLoadImage(image.imageData(), image.imageSize(), ltDownloadAndRun) != 0)
+        return error("Helper load failed");
+
+    /* select the sd helper baud rate */
+    connection->setBaudRate(dat->baudrate);
+
+    return 0;
+}
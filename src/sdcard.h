@@ -0,0 +1,13 @@
+#ifndef __SDCARD_H__
+#define __SDCARD_H__
+
+#include "propconnection.h"
+#include "config.h"
+
+/* write a single file to the SD card */
+int WriteFileToSDCard(BoardConfig *config, PropConnection *connection, const char *path, const char *target);
+
+/* write every changed file in a directory or manifest to the SD card using a single helper session */
+int SyncFilesToSDCard(BoardConfig *config, PropConnection *connection, const char *source);
+
+#endif
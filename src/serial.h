@@ -30,6 +30,8 @@
 #ifndef __SERIAL_IO_H__
 #define __SERIAL_IO_H__
 
+#include "terminal.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -43,18 +45,31 @@ typedef enum {
 
 typedef struct SERIAL SERIAL;
 
+/* what the OS knows about the adapter behind a port without opening it */
+typedef struct {
+    int vid;                /* USB vendor ID (0 if unknown) */
+    int pid;                /* USB product ID */
+    char serialNumber[64];  /* USB serial number ("" if unknown) */
+    char manufacturer[64];  /* USB manufacturer string ("" if unknown) */
+    char product[64];       /* USB product string ("" if unknown) */
+} SerialPortInfo;
+
 int SerialUseResetMethod(SERIAL *serial, char *method);
+void SerialSetResetDelay(SERIAL *serial, int delay);
+void SerialSetResetPulse(SERIAL *serial, int pulse);
 int OpenSerial(const char *port, int baud, SERIAL **pSerial);
 void CloseSerial(SERIAL *serial);
 int SetSerialBaud(SERIAL *serial, int baud);
 int SerialGenerateResetSignal(SERIAL *serial);
+int SerialGenerateResetSignalAndSend(SERIAL *serial, const void *buf, int len);
 int SendSerialData(SERIAL *serial, const void *buf, int len);
 int FlushSerialData(SERIAL *serial);
 int ReceiveSerialData(SERIAL *serial, void *buf, int len);
 int ReceiveSerialDataTimeout(SERIAL *serial, void *buf, int len, int timeout);
 int ReceiveSerialDataExactTimeout(SERIAL *serial, void *buf, int len, int timeout);
 int SerialFind(const char *prefix, int (*check)(const char *port, void *data), void *data);
-void SerialTerminal(SERIAL *serial, int check_for_exit, int pst_mode);
+int SerialGetPortInfo(const char *port, SerialPortInfo *info);
+void SerialTerminal(SERIAL *serial, const TerminalOptions *options);
 
 #ifdef __cplusplus
 }
@@ -36,13 +36,22 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include "serial.h"
+#include "proploader.h"
 
 static void ShowLastError(void);
 
+/* time to wait after reset before talking to the Propeller */
+#define DEF_RESET_DELAY     90
+
+/* width of the reset pulse in milliseconds */
+#define DEF_RESET_PULSE     25
+
 struct SERIAL {
     COMMTIMEOUTS originalTimeouts;
     COMMTIMEOUTS timeouts;
     reset_method_t resetMethod;
+    int resetDelay;
+    int resetPulse;
     HANDLE hSerial;
 };
 
@@ -57,6 +66,16 @@ int SerialUseResetMethod(SERIAL *serial, char *method)
     return 0;
 }
 
+void SerialSetResetDelay(SERIAL *serial, int delay)
+{
+    serial->resetDelay = delay >= 0 ? delay : DEF_RESET_DELAY;
+}
+
+void SerialSetResetPulse(SERIAL *serial, int pulse)
+{
+    serial->resetPulse = pulse > 0 ? pulse : DEF_RESET_PULSE;
+}
+
 int OpenSerial(const char *port, int baud, SERIAL **pSerial)
 {
     char fullPort[20];
@@ -71,6 +90,8 @@ int OpenSerial(const char *port, int baud, SERIAL **pSerial)
     /* initialize the state structure */
     memset(serial, 0, sizeof(SERIAL));
     serial->resetMethod = RESET_WITH_DTR;
+    serial->resetDelay = DEF_RESET_DELAY;
+    serial->resetPulse = DEF_RESET_PULSE;
 
     sprintf(fullPort, "\\\\.\\%s", port);
 
@@ -178,12 +199,30 @@ int SetSerialBaud(SERIAL *serial, int baud)
     return 0;
 }
 
+/* the port names from enumcom don't lead back to the USB device so nothing is known without opening it */
+int SerialGetPortInfo(const char *port, SerialPortInfo *info)
+{
+    memset(info, 0, sizeof(SerialPortInfo));
+    return -1;
+}
+
 int SerialGenerateResetSignal(SERIAL *serial)
+{
+    return SerialGenerateResetSignalAndSend(serial, NULL, 0);
+}
+
+int SerialGenerateResetSignalAndSend(SERIAL *serial, const void *buf, int len)
 {
     EscapeCommFunction(serial->hSerial, serial->resetMethod == RESET_WITH_RTS ? SETRTS : SETDTR);
-    Sleep(25);
+    Sleep(serial->resetPulse);
+    if (buf) {
+        // Purge while the Propeller is held in reset and send as soon as it is released.
+        PurgeComm(serial->hSerial, PURGE_RXABORT | PURGE_RXCLEAR);
+        EscapeCommFunction(serial->hSerial, serial->resetMethod == RESET_WITH_RTS ? CLRRTS : CLRDTR);
+        return SendSerialData(serial, buf, len) == len ? 0 : -1;
+    }
     EscapeCommFunction(serial->hSerial, serial->resetMethod == RESET_WITH_RTS ? CLRRTS : CLRDTR);
-    Sleep(90);
+    Sleep(serial->resetDelay);
     // Purge here after reset helps to get rid of buffered data.
     PurgeComm(serial->hSerial, PURGE_TXABORT | PURGE_RXABORT | PURGE_TXCLEAR | PURGE_RXCLEAR);
     return 0;
@@ -193,7 +232,7 @@ int SendSerialData(SERIAL *serial, const void *buf, int len)
 {
     DWORD dwBytes = 0;
     if (!WriteFile(serial->hSerial, buf, len, &dwBytes, NULL)) {
-        printf("Error writing port\n");
+        message("Error writing port");
         ShowLastError();
         return -1;
     }
@@ -212,7 +251,7 @@ int ReceiveSerialData(SERIAL *serial, void *buf, int len)
     serial->timeouts.ReadTotalTimeoutConstant = 0;
     SetCommTimeouts(serial->hSerial, &serial->timeouts);
     if (!ReadFile(serial->hSerial, buf, len, &dwBytes, NULL)) {
-        printf("Error reading port\n");
+        message("Error reading port");
         ShowLastError();
         return -1;
     }
@@ -226,7 +265,7 @@ int ReceiveSerialDataTimeout(SERIAL *serial, void *buf, int len, int timeout)
     serial->timeouts.ReadTotalTimeoutConstant = timeout;
     SetCommTimeouts(serial->hSerial, &serial->timeouts);
     if (!ReadFile(serial->hSerial, buf, len, &dwBytes, NULL)) {
-        printf("Error reading port\n");
+        message("Error reading port");
         ShowLastError();
         return -1;
     }
@@ -255,7 +294,7 @@ int ReceiveSerialDataExactTimeout(SERIAL *serial, void *buf, int len, int timeou
     
         /* read the next bit of data */
         if (!ReadFile(serial->hSerial, ptr, remaining, &dwBytes, NULL)) {
-            printf("Error reading port\n");
+            message("Error reading port");
             ShowLastError();
             return -1;
         }
@@ -287,62 +326,61 @@ static void ShowLastError(void)
         MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
         (LPTSTR)&lpMsgBuf,
         0, NULL);
-    printf("    %s\n", (char *)lpMsgBuf);
+    message("    %s", (char *)lpMsgBuf);
     LocalFree(lpMsgBuf);
 }
 
-/* escape from terminal mode */
-#define ESC         0x1b
-
-/*
- * if "check_for_exit" is true, then
- * a sequence EXIT_CHAR 00 nn indicates that we should exit
- */
-#define EXIT_CHAR   0xff
-
-void SerialTerminal(SERIAL *serial, int check_for_exit, int pst_mode)
+void SerialTerminal(SERIAL *serial, const TerminalOptions *options)
 {
-    int sawexit_char = 0;
-    int sawexit_valid = 0;
-    int exitcode = 0;
-    int continue_terminal = 1;
-
-    while (continue_terminal) {
-        uint8_t buf[1];
-        if (ReceiveSerialDataTimeout(serial, buf, 1, 0) != -1) {
-            if (sawexit_valid) {
-                exitcode = buf[0];
-                continue_terminal = 0;
-            }
-            else if (sawexit_char) {
-                if (buf[0] == 0) {
-                    sawexit_valid = 1;
-                } else {
-                    putchar(EXIT_CHAR);
-                    putchar(buf[0]);
-                    fflush(stdout);
-                }
-            }
-            else if (check_for_exit && buf[0] == EXIT_CHAR) {
-                sawexit_char = 1;
-            }
-            else {
-                putchar(buf[0]);
-                if (pst_mode && buf[0] == '\r')
-                    putchar('\n');
-                fflush(stdout);
+    uint8_t *buf, *out = NULL;
+    TerminalFilter filter;
+    FILE *capture = NULL;
+    int display, cnt;
+
+    if (!(buf = (uint8_t *)malloc(TERMINAL_BUFFER_SIZE)))
+        return;
+    if (TerminalFilterNeeded(options) && !(out = (uint8_t *)malloc(TERMINAL_BUFFER_SIZE * TERMINAL_FILTER_EXPANSION))) {
+        free(buf);
+        return;
+    }
+    if (options->captureFile && !(capture = fopen(options->captureFile, "wb"))) {
+        printf("error: can't create capture file '%s'\n", options->captureFile);
+        free(out);
+        free(buf);
+        return;
+    }
+    display = !(options->headless && capture);
+    TerminalFilterInit(&filter, options);
+
+    while (!filter.done) {
+
+        /* take everything that arrives within the timeout rather than a byte at a time */
+        if ((cnt = ReceiveSerialDataTimeout(serial, buf, TERMINAL_BUFFER_SIZE, 10)) > 0) {
+            if (capture)
+                fwrite(buf, 1, cnt, capture);
+            if (out) {
+                cnt = TerminalFilterProcess(&filter, buf, cnt, out);
+                if (display)
+                    fwrite(out, 1, cnt, stdout);
             }
+            else if (display)
+                fwrite(buf, 1, cnt, stdout);
+            fflush(stdout);
         }
-        else if (kbhit()) {
-            if ((buf[0] = getch()) == ESC)
+        else if (!options->headless && kbhit()) {
+            if ((buf[0] = getch()) == TERMINAL_ESC)
                 break;
             SendSerialData(serial, buf, 1);
         }
     }
 
-    if (check_for_exit && sawexit_valid) {
-        exit(exitcode);
-    }
+    if (capture)
+        fclose(capture);
+    free(out);
+    free(buf);
+
+    if (filter.sawExitValid)
+        exit(filter.exitCode);
 }
 
 #if 0
@@ -39,22 +39,34 @@
 #include <termios.h>
 #include <sys/ioctl.h>
 #include <sys/timeb.h>
-#include <sys/select.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <limits.h>
 #include <signal.h>
 
 #include "serial.h"
+#include "ioreactor.h"
+#include "proploader.h"
 #ifdef RASPBERRY_PI
 #include "gpio_sysfs.h"
+#include "gpio_chardev.h"
 #endif
+
+/* time to wait after reset before talking to the Propeller */
+#define DEF_RESET_DELAY     100
+
+/* width of the reset pulse in milliseconds */
+#define DEF_RESET_PULSE     10
+
 struct SERIAL {
     struct termios oldParams;
     reset_method_t resetMethod;
+    int resetDelay;
+    int resetPulse;
 #ifdef RASPBERRY_PI
     int resetGpioPin;
     int resetGpioLevel;
+    GPIOLine *resetLine;    /* NULL when using sysfs */
 #endif
     int fd;
 };
@@ -67,7 +79,7 @@ static void msleep(int ms)
 static void chk(char *fun, int sts)
 {
     if (sts != 0)
-        printf("%s failed\n", fun);
+        message("%s failed", fun);
 }
 
 int SerialUseResetMethod(SERIAL *serial, char *method)
@@ -79,6 +91,7 @@ int SerialUseResetMethod(SERIAL *serial, char *method)
 #ifdef RASPBERRY_PI
     else if (strncasecmp(method, "gpio", 4) == 0)
     {
+        const char *chip = NULL;
         serial->resetMethod = RESET_WITH_GPIO;
 
         char *token;
@@ -95,20 +108,28 @@ int SerialUseResetMethod(SERIAL *serial, char *method)
             {
                 serial->resetGpioLevel = atoi(token); 
             }
+            chip = strtok(NULL, ",");
         }
 
-        printf ("Using GPIO pin %d as Propeller reset ", serial->resetGpioPin);
-        if (serial->resetGpioLevel)
+        message("Using GPIO pin %d as Propeller reset (%s)", serial->resetGpioPin, serial->resetGpioLevel ? "HIGH" : "LOW");
+
+        /* use the character device if the kernel has it since it keeps the line open */
+        if (serial->resetLine && GpioLineMatches(serial->resetLine, chip, serial->resetGpioPin))
         {
-            printf ("(HIGH).\n");
+            GpioLineSet(serial->resetLine, serial->resetGpioLevel ^ 1);
+            return 0;
         }
-        else
+        if (serial->resetLine)
         {
-            printf ("(LOW).\n");
+            GpioLineClose(serial->resetLine);
+        }
+        serial->resetLine = GpioLineOpen(chip, serial->resetGpioPin, serial->resetGpioLevel ^ 1);
+        if (!serial->resetLine)
+        {
+            gpio_export(serial->resetGpioPin);
+            gpio_write(serial->resetGpioPin, serial->resetGpioLevel ^ 1);
+            gpio_direction(serial->resetGpioPin, 1);
         }
-        gpio_export(serial->resetGpioPin);
-        gpio_write(serial->resetGpioPin, serial->resetGpioLevel ^ 1);
-        gpio_direction(serial->resetGpioPin, 1);
     }
 #endif
     else {
@@ -117,6 +138,16 @@ int SerialUseResetMethod(SERIAL *serial, char *method)
     return 0;
 }
 
+void SerialSetResetDelay(SERIAL *serial, int delay)
+{
+    serial->resetDelay = delay >= 0 ? delay : DEF_RESET_DELAY;
+}
+
+void SerialSetResetPulse(SERIAL *serial, int pulse)
+{
+    serial->resetPulse = pulse > 0 ? pulse : DEF_RESET_PULSE;
+}
+
 int OpenSerial(const char *port, int baud, SERIAL **pSerial)
 {
     struct termios sparams;
@@ -130,6 +161,8 @@ int OpenSerial(const char *port, int baud, SERIAL **pSerial)
     /* initialize the state structure */
     memset(serial, 0, sizeof(SERIAL));
     serial->resetMethod = RESET_WITH_DTR;
+    serial->resetDelay = DEF_RESET_DELAY;
+    serial->resetPulse = DEF_RESET_PULSE;
 #ifdef RASPBERRY_PI
     serial->resetGpioPin = 17;
     serial->resetGpioLevel = 0;
@@ -143,7 +176,7 @@ int OpenSerial(const char *port, int baud, SERIAL **pSerial)
     serial->fd = open(port, O_RDWR | O_NOCTTY | O_NDELAY | O_NONBLOCK);
 #endif
     if(serial->fd == -1) {
-        printf("error: opening '%s' -- %s\n", port, strerror(errno));
+        message("118-Can't open '%s': %s", port, strerror(errno));
         free(serial);
         return -3;
     }
@@ -154,7 +187,7 @@ int OpenSerial(const char *port, int baud, SERIAL **pSerial)
 
     /* set the terminal to exclusive mode */
     if (ioctl(serial->fd, TIOCEXCL) != 0) {
-        printf("error: can't open terminal for exclusive access\n");
+        message("119-Can't open '%s' for exclusive access", port);
         close(serial->fd);
         free(serial);
         return -4;
@@ -206,6 +239,10 @@ void CloseSerial(SERIAL *serial)
         ioctl(serial->fd, TIOCNXCL);
         close(serial->fd);
     }
+#ifdef RASPBERRY_PI
+    if (serial->resetLine)
+        GpioLineClose(serial->resetLine);
+#endif
     free(serial);
 }
 
@@ -299,9 +336,35 @@ int SetSerialBaud(SERIAL *serial, int baud)
 }
 
 int SerialGenerateResetSignal(SERIAL *serial)
+{
+    return SerialGenerateResetSignalAndSend(serial, NULL, 0);
+}
+
+/*
+ * With a buffer the input is flushed while the Propeller is still held in reset
+ * and the buffer is written as soon as reset is released instead of waiting out
+ * the reset delay. This only works on boards where the ROM is listening by the
+ * time the first byte has been shifted out.
+ */
+int SerialGenerateResetSignalAndSend(SERIAL *serial, const void *buf, int len)
 {
     int cmd;
     
+#ifdef RASPBERRY_PI
+    /* the character device times the whole pulse itself */
+    if (serial->resetMethod == RESET_WITH_GPIO && serial->resetLine) {
+        if (buf) {
+            tcflush(serial->fd, TCIFLUSH);
+            GpioLinePulse(serial->resetLine, serial->resetGpioLevel, serial->resetPulse * 1000);
+            return SendSerialData(serial, buf, len) == len ? 0 : -1;
+        }
+        GpioLinePulse(serial->resetLine, serial->resetGpioLevel, serial->resetPulse * 1000);
+        msleep(serial->resetDelay);
+        tcflush(serial->fd, TCIFLUSH);
+        return 0;
+    }
+#endif
+
     /* assert the reset signal */
     switch (serial->resetMethod) {
     case RESET_WITH_DTR:
@@ -322,7 +385,11 @@ int SerialGenerateResetSignal(SERIAL *serial)
         break;
     }
 
-    msleep(10);
+    msleep(serial->resetPulse);
+    
+    /* nothing the Propeller sends while it is held in reset is wanted */
+    if (buf)
+        tcflush(serial->fd, TCIFLUSH);
     
     /* deassert the reset signal */
     switch (serial->resetMethod) {
@@ -344,7 +411,11 @@ int SerialGenerateResetSignal(SERIAL *serial)
         break;
     }
 
-    msleep(100);
+    /* send the pre-queued bytes right away */
+    if (buf)
+        return SendSerialData(serial, buf, len) == len ? 0 : -1;
+    
+    msleep(serial->resetDelay);
     
     /* flush any pending input */
     tcflush(serial->fd, TCIFLUSH);
@@ -357,7 +428,7 @@ int SendSerialData(SERIAL *serial, const void *buf, int len)
     int cnt;
     cnt = write(serial->fd, buf, len);
     if (cnt != len) {
-        printf("Error writing port\n");
+        message("Error writing port");
         return -1;
     }
     return cnt;
@@ -372,7 +443,7 @@ int ReceiveSerialData(SERIAL *serial, void *buf, int len)
 {
     int cnt = read(serial->fd, buf, len);
     if (cnt < 1) {
-        printf("Error reading port\n");
+        message("Error reading port");
         return -1;
     }
     return cnt;
@@ -380,63 +451,39 @@ int ReceiveSerialData(SERIAL *serial, void *buf, int len)
 
 int ReceiveSerialDataTimeout(SERIAL *serial, void *buf, int len, int timeout)
 {
-    ssize_t bytes = 0;
-    struct timeval toval;
-    fd_set set;
-
-    /* initialize the socket set */
-    FD_ZERO(&set);
-    FD_SET(serial->fd, &set);
-
-    /* setup the timeout */
-    toval.tv_sec = timeout / 1000;
-    toval.tv_usec = (timeout % 1000) * 1000;
+    ssize_t bytes;
 
     /* wait for data to be available on the port */
-    if (select(serial->fd + 1, &set, NULL, NULL, &toval) <= 0)
+    if (IOWaitReadable(serial->fd, IODeadline(timeout)) <= 0)
         return -1;
 
     /* read the incoming data */
-    if (FD_ISSET(serial->fd, &set))
-        bytes = read(serial->fd, buf, len);
+    bytes = read(serial->fd, buf, len);
 
     return (int)(bytes > 0 ? bytes : -1);
 }
 
 int ReceiveSerialDataExactTimeout(SERIAL *serial, void *buf, int len, int timeout)
 {
+    int64_t deadline = IODeadline(timeout);
     uint8_t *ptr = (uint8_t *)buf;
     int remaining = len;
     int cnt = 0;
-    struct timeval toval;
-    fd_set set;
 
     /* return only when the buffer contains the exact amount of data requested */
     while (remaining > 0) {
         
-        /* initialize the socket set */
-        FD_ZERO(&set);
-        FD_SET(serial->fd, &set);
-
-        /* setup the timeout */
-        toval.tv_sec = timeout / 1000;
-        toval.tv_usec = (timeout % 1000) * 1000;
-
-        /* wait for data to be available on the port */
-        if (select(serial->fd + 1, &set, NULL, NULL, &toval) <= 0)
+        /* wait for data to be available on the port (the timeout covers the whole buffer) */
+        if (IOWaitReadable(serial->fd, deadline) <= 0)
             return -1;
 
-        /* read the incoming data */
-        if (FD_ISSET(serial->fd, &set)) {
-        
-            /* read the next bit of data */
-            if ((cnt = read(serial->fd, ptr, remaining)) < 0)
-                return -1;
+        /* read the next bit of data */
+        if ((cnt = read(serial->fd, ptr, remaining)) < 0)
+            return -1;
                 
-            /* update the buffer pointer */
-            remaining -= cnt;
-            ptr += cnt;
-        }
+        /* update the buffer pointer */
+        remaining -= cnt;
+        ptr += cnt;
     }
 
     /* return the full size of the buffer */
@@ -467,6 +514,72 @@ int SerialFind(const char *prefix, int (*check)(const char *port, void *data), v
     return -1;
 }
 
+#ifdef LINUX
+
+/* read the first line of a sysfs attribute */
+static int ReadAttribute(const char *dir, const char *name, char *buf, int size)
+{
+    char path[PATH_MAX];
+    FILE *fp;
+    int len;
+    
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (!(fp = fopen(path, "r")))
+        return -1;
+    if (!fgets(buf, size, fp)) {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    
+    len = strlen(buf);
+    if (len > 0 && buf[len - 1] == '\n')
+        buf[len - 1] = '\0';
+    return 0;
+}
+
+#endif
+
+/*
+ * On Linux the USB IDs come from the device the tty hangs off in sysfs.
+ * That is the interface for ttyACM ports and a usb-serial port below the
+ * interface for ttyUSB ports so walk up until a directory has an idVendor.
+ */
+int SerialGetPortInfo(const char *port, SerialPortInfo *info)
+{
+#ifdef LINUX
+    char path[PATH_MAX], dir[PATH_MAX], value[64];
+    const char *name;
+    char *p;
+    int level;
+    
+    memset(info, 0, sizeof(SerialPortInfo));
+    
+    name = (p = strrchr(port, '/')) != NULL ? p + 1 : port;
+    snprintf(path, sizeof(path), "/sys/class/tty/%s/device", name);
+    if (!realpath(path, dir))
+        return -1;
+    
+    for (level = 0; level < 4; ++level) {
+        if (ReadAttribute(dir, "idVendor", value, sizeof(value)) == 0) {
+            info->vid = (int)strtol(value, NULL, 16);
+            if (ReadAttribute(dir, "idProduct", value, sizeof(value)) == 0)
+                info->pid = (int)strtol(value, NULL, 16);
+            ReadAttribute(dir, "serial", info->serialNumber, sizeof(info->serialNumber));
+            ReadAttribute(dir, "manufacturer", info->manufacturer, sizeof(info->manufacturer));
+            ReadAttribute(dir, "product", info->product, sizeof(info->product));
+            return 0;
+        }
+        if (!(p = strrchr(dir, '/')) || p == dir)
+            break;
+        *p = '\0';
+    }
+#else
+    memset(info, 0, sizeof(SerialPortInfo));
+#endif
+    return -1;
+}
+
 #if 0
 
 static void sigint_handler(int signum)
@@ -477,92 +590,10 @@ static void sigint_handler(int signum)
 
 #endif
 
-#define ESC     0x1b    /* escape from terminal mode */
-
 /**
  * simple terminal emulator
  */
-void SerialTerminal(SERIAL *serial, int check_for_exit, int pst_mode)
+void SerialTerminal(SERIAL *serial, const TerminalOptions *options)
 {
-    struct termios oldt, newt;
-    char buf[128], realbuf[256]; // double in case buf is filled with \r in PST mode
-    ssize_t cnt;
-    fd_set set;
-    int exit_char = 0xdead; /* not a valid character */
-    int sawexit_char = 0;
-    int sawexit_valid = 0; 
-    int exitcode = 0;
-    int continue_terminal = 1;
-
-    tcgetattr(STDIN_FILENO, &oldt);
-    newt = oldt;
-    newt.c_lflag &= ~(ICANON | ECHO | ISIG);
-    newt.c_iflag &= ~(ICRNL | INLCR);
-    newt.c_oflag &= ~OPOST;
-    tcsetattr(STDIN_FILENO, TCSANOW, &newt);
-
-    if (check_for_exit)
-        exit_char = 0xff;
-
-#if 0
-    /* make it possible to detect breaks */
-    tcgetattr(serial->fd, &newt);
-    newt.c_iflag &= ~IGNBRK;
-    newt.c_iflag |= PARMRK;
-    tcsetattr(serial->fd, TCSANOW, &newt);
-#endif
-
-    do {
-        FD_ZERO(&set);
-        FD_SET(serial->fd, &set);
-        FD_SET(STDIN_FILENO, &set);
-        if (select(serial->fd + 1, &set, NULL, NULL, NULL) > 0) {
-            if (FD_ISSET(serial->fd, &set)) {
-                if ((cnt = read(serial->fd, buf, sizeof(buf))) > 0) {
-                    int i;
-                    // check for breaks
-                    ssize_t realbytes = 0;
-                    for (i = 0; i < cnt; i++) {
-                      if (sawexit_valid)
-                        {
-                          exitcode = buf[i];
-                          continue_terminal = 0;
-                        }
-                      else if (sawexit_char) {
-                        if (buf[i] == 0) {
-                          sawexit_valid = 1;
-                        } else {
-                          realbuf[realbytes++] = exit_char;
-                          realbuf[realbytes++] = buf[i];
-                          sawexit_char = 0;
-                        }
-                      } else if (((int)buf[i] & 0xff) == exit_char) {
-                        sawexit_char = 1;
-                      } else {
-                        realbuf[realbytes++] = buf[i];
-                        if (pst_mode && buf[i] == '\r')
-                            realbuf[realbytes++] = '\n';
-                      }
-                    }
-                    write(fileno(stdout), realbuf, realbytes);
-                }
-            }
-            if (FD_ISSET(STDIN_FILENO, &set)) {
-                if ((cnt = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
-                    int i;
-                    for (i = 0; i < cnt; ++i) {
-                        if (buf[i] == ESC)
-                            goto done;
-                    }
-                    write(serial->fd, buf, cnt);
-                }
-            }
-        }
-    } while (continue_terminal);
-
-done:
-    tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
-
-    if (sawexit_valid)
-        exit(exitcode);
+    TerminalRun(serial->fd, 0, options);
 }
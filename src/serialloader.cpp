@@ -8,11 +8,14 @@
 #include <string.h>
 #include <math.h>
 #include <unistd.h>
+#include <chrono>
 #include "serialpropconnection.h"
 #include "proploader.h"
 
 #define MAX_BUFFER_SIZE         32768   /* The maximum buffer size. (BUG: git rid of this magic number) */
 #define LENGTH_FIELD_SIZE       11      /* number of bytes in the length field */
+#define HANDSHAKE_MARGIN        250     /* time allowed beyond sending everything ahead of the handshake response (ms) */
+#define HANDSHAKE_GAP           100     /* longest silence allowed once the handshake response has started (ms) */
 
 // Propeller Download Stream Translator array.  Index into this array using the "Binary Value" (usually 5 bits) to translate,
 // the incoming bit size (again, usually 5), and the desired data element to retrieve (encoding = translation, bitCount = bit count
@@ -142,6 +145,18 @@ static uint8_t rxHandshake[] = {
     0xEE,0xCE,0xCF,0xCE,0xCE,0xCF,0xCE,0xEE,0xEF,0xEE,0xEF,0xEF,0xCF,0xEF,0xCE,0xCE,
     0xEF,0xCE,0xEE,0xCE,0xEF,0xCE,0xCE,0xEE,0xCF,0xCF,0xCE,0xCF,0xCF};
 
+// Timing templates sent after the TxHandshake to clock out the RxHandshake and the version; one response byte each.
+static const uint8_t timingTemplates[sizeof(rxHandshake) + 4] = {
+    0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,
+    0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,
+    0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,
+    0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,
+    0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,
+    0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,
+    0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,
+    0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,0xF9,
+    0xF9};
+
 /* EncodeBytes
     parameters:
         inBytes is a pointer to a buffer of bytes to be encoded
@@ -266,10 +281,49 @@ static uint8_t *GenerateLoaderPacket(const uint8_t *image, int imageSize, int *p
     return packet;
 }
 
+/*
+ * Receive the handshake response and the hardware version checking each byte
+ * against rxHandshake as it arrives. byteCount is the number of bytes queued
+ * ahead of the response so a board that isn't there is given up on shortly
+ * after they could have been sent rather than after a fixed timeout. Once the
+ * response starts it arrives at the serial rate so a gap means it has stopped.
+ */
+int SerialPropConnection::receiveHandshake(int *pVersion, int byteCount)
+{
+    int timeout = (byteCount * 10 * 1000) / m_baudRate + HANDSHAKE_MARGIN;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    uint8_t response[sizeof(rxHandshake) + 4];
+    int version, cnt, end, remaining, i;
+    
+    for (cnt = 0; cnt < (int)sizeof(response); ) {
+        remaining = (int)std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        if (remaining <= 0 || (end = receiveDataTimeout(&response[cnt], sizeof(response) - cnt, remaining)) < 0) {
+            message("Handshake response stopped after %d of %d bytes", cnt, (int)sizeof(response));
+            return -1;
+        }
+        
+        /* give up at the first byte that doesn't match */
+        for (end += cnt; cnt < end; ++cnt) {
+            if (cnt < (int)sizeof(rxHandshake) && response[cnt] != rxHandshake[cnt]) {
+                message("Handshake mismatch at byte %d: expected %02x, got %02x", cnt, rxHandshake[cnt], response[cnt]);
+                return -1;
+            }
+        }
+        
+        deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(HANDSHAKE_GAP);
+    }
+    
+    /* decode the hardware version */
+    version = 0;
+    for (i = sizeof(rxHandshake); i < cnt; ++i)
+        version = ((version >> 2) & 0x3F) | ((response[i] & 0x01) << 6) | ((response[i] & 0x20) << 2);
+    
+    *pVersion = version;
+    return 0;
+}
+
 int SerialPropConnection::identify(int *pVersion)
 {
-    uint8_t packet2[MAX_BUFFER_SIZE]; // must be at least as big as maxDataSize()
-    int version, cnt, i;
     uint8_t *packet;
     int packetSize;
     
@@ -279,34 +333,20 @@ int SerialPropConnection::identify(int *pVersion)
         goto fail;
     }
 
-    /* reset the Propeller */
-    generateResetSignal();
-    
-    /* send the identify packet */
-    sendData(packet, packetSize);
-    
-    /* send the verification packet (all timing templates) */
-    memset(packet2, 0xF9, maxDataSize());
-    sendData(packet2, maxDataSize());
+    /* reset the Propeller and send the identify packet */
+    resetAndSend(packet, packetSize);
+    free(packet);
     
-    /* receive the handshake response and the hardware version */
-    cnt = receiveDataExactTimeout(packet2, sizeof(rxHandshake) + 4, 2000);
-    if (cnt < 0)
-        goto fail;
+    /* send exactly the timing templates needed for the response */
+    sendData(timingTemplates, sizeof(timingTemplates));
     
-    /* verify the handshake response */
-    if (cnt != sizeof(rxHandshake) + 4 || memcmp(packet2, rxHandshake, sizeof(rxHandshake)) != 0) {
+    /* receive and verify the handshake response and the hardware version */
+    if (receiveHandshake(pVersion, packetSize + sizeof(timingTemplates)) != 0) {
         message("Handshake failed");
         goto fail;
     }
     
-    /* verify the hardware version */
-    version = 0;
-    for (i = sizeof(rxHandshake); i < cnt; ++i)
-        version = ((version >> 2) & 0x3F) | ((packet2[i] & 0x01) << 6) | ((packet2[i] & 0x20) << 2);
-    
     /* return successfully */
-    *pVersion = version;
     return 0;
     
     /* return failure */
@@ -325,41 +365,46 @@ int SerialPropConnection::loadImage(const uint8_t *image, int imageSize, uint8_t
 int SerialPropConnection::loadImage(const uint8_t *image, int imageSize, LoadType loadType)
 {
     uint8_t packet2[MAX_BUFFER_SIZE]; // must be at least as big as maxDataSize()
-    int packetSize, version, retries, cnt, i;
+    int packetSize, version, retries, cnt;
     uint8_t *packet;
     
     /* use the loader baud rate */
     if (setBaudRate(loaderBaudRate()) != 0) 
         return -1;
         
-    /* generate a loader packet */
-    if (!(packet = GenerateLoaderPacket(image, imageSize, &packetSize, loadType)))
-        return -1;
-
-    /* reset the Propeller */
-    generateResetSignal();
+    /* reuse the last loader packet when the same image is loaded again */
+    if (m_loaderImage && imageSize == m_loaderImageSize && loadType == m_loaderLoadType && memcmp(image, m_loaderImage, imageSize) == 0) {
+        packet = m_loaderPacket;
+        packetSize = m_loaderPacketSize;
+    }
     
-    /* send the packet including the image */
-    sendData(packet, packetSize);
-    free(packet);
+    /* otherwise generate a new loader packet */
+    else {
+        freeLoaderPacket();
+        if (!(packet = GenerateLoaderPacket(image, imageSize, &packetSize, loadType)))
+            return -1;
+        if ((m_loaderImage = (uint8_t *)malloc(imageSize)) != NULL) {
+            memcpy(m_loaderImage, image, imageSize);
+            m_loaderImageSize = imageSize;
+            m_loaderLoadType = loadType;
+        }
+        m_loaderPacket = packet;
+        m_loaderPacketSize = packetSize;
+    }
+
+    /* reset the Propeller and send the packet including the image */
+    resetAndSend(packet, packetSize);
     
     /* clock out the handshake response */
-    memset(packet2, 0xF9, sizeof(rxHandshake) + 4);
-    sendData(packet2, sizeof(rxHandshake) + 4);
-    
-    /* receive the handshake response and the hardware version */
-    cnt = receiveDataExactTimeout(packet2, sizeof(rxHandshake) + 4, 2000);
+    sendData(timingTemplates, sizeof(timingTemplates));
     
-    /* verify the handshake response */
-    if (cnt != sizeof(rxHandshake) + 4 || memcmp(packet2, rxHandshake, sizeof(rxHandshake)) != 0) {
+    /* receive and verify the handshake response and the hardware version */
+    if (receiveHandshake(&version, packetSize + sizeof(timingTemplates)) != 0) {
         message("Handshake failed");
         return -1;
     }
     
     /* verify the hardware version */
-    version = 0;
-    for (i = sizeof(rxHandshake); i < cnt; ++i)
-        version = ((version >> 2) & 0x3F) | ((packet2[i] & 0x01) << 6) | ((packet2[i] & 0x20) << 2);
     if (version != 1) {
         message("Wrong propeller version");
         return -1;
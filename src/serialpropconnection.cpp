@@ -1,10 +1,29 @@
 #include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <vector>
+#include <chrono>
 #include "serialpropconnection.h"
+#include "loadercache.h"
+#include "proploader.h"
 
 #define CALIBRATE_DELAY         10
 
+/* how much later than the reset delay the handshake may start when the reset ran ahead of the loader packet (ms) */
+#define RESET_LATE_LIMIT        20
+
+/* Parallax programs its name into the USB strings of the Prop Plug and its boards (their FTDI IDs are shared with every other FTDI cable) */
+#define PROPELLER_ADAPTER_VENDOR    "parallax"
+
 SerialPropConnection::SerialPropConnection()
-    : m_serialPort(NULL)
+    : m_serialPort(NULL),
+      m_loaderImage(NULL),
+      m_loaderImageSize(0),
+      m_loaderLoadType(ltShutdown),
+      m_loaderPacket(NULL),
+      m_loaderPacketSize(0),
+      m_prequeueHandshake(false),
+      m_resetStatus(0)
 {
     m_loaderBaudRate = SERIAL_LOADER_BAUD_RATE;
     m_fastLoaderBaudRate = SERIAL_FAST_LOADER_BAUD_RATE;
@@ -14,32 +33,143 @@ SerialPropConnection::SerialPropConnection()
 SerialPropConnection::~SerialPropConnection()
 {
     close();
+    freeLoaderPacket();
+}
+
+void SerialPropConnection::freeLoaderPacket()
+{
+    if (m_loaderImage) {
+        free(m_loaderImage);
+        m_loaderImage = NULL;
+    }
+    if (m_loaderPacket) {
+        free(m_loaderPacket);
+        m_loaderPacket = NULL;
+    }
 }
 
 // this is in serialloader.cpp
 // int SerialPropConnection::loadImage(const uint8_t *image, int imageSize, LoadType loadType);
 
-struct FindState {
-    SerialInfoList *list;
-    int count;
-};
+bool SerialInfo::isPropellerAdapter()
+{
+    std::string strings = m_manufacturer + " " + m_product;
+    for (int i = 0; i < (int)strings.size(); ++i)
+        strings[i] = tolower(strings[i]);
+    return strings.find(PROPELLER_ADAPTER_VENDOR) != std::string::npos;
+}
 
 int SerialPropConnection::addPort(const char *port, void *data)
 {
-    FindState *state = (FindState *)data;
+    SerialInfoList *candidates = (SerialInfoList *)data;
+    SerialPortInfo portInfo;
     
-    SerialInfo info(port);
-    state->list->push_back(info);
+    SerialGetPortInfo(port, &portInfo);
+    SerialInfo info(port, portInfo);
+    candidates->push_back(info);
     
-    return state->count < 0 || --state->count > 0;
+    return 1;
 }
 
-int SerialPropConnection::findPorts(const char *prefix, bool check, SerialInfoList &list, int count)
+/* runs on its own thread reporting to wherever the thread that started it does */
+void SerialPropConnection::identifyPort(SerialInfo *info, BoardConfig *config, MessageContext context)
 {
-    FindState state;
-    state.list = &list;
-    state.count = count;
-    SerialFind(prefix, addPort, &state);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    SerialPropConnection connection;
+    int version = 0;
+    
+    SetMessageContext(&context);
+    
+    if (connection.open(info->port()) != 0
+    ||  (config && LoaderCache::configure(&connection, config) != 0)
+    ||  connection.identify(&version) != 0) {
+        message("No Propeller answered on %s", info->port());
+        version = 0;
+    }
+    connection.close();
+    
+    std::chrono::milliseconds elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    info->setIdentified(version, (int)elapsed.count());
+}
+
+/*
+ * Reset and identify every port at once so the time taken is that of the
+ * slowest port. The connections use config's baud rates and reset settings
+ * if it is given and the defaults otherwise.
+ */
+void SerialPropConnection::identifyPorts(SerialInfoList &list, BoardConfig *config)
+{
+    std::vector<std::thread> threads;
+    SerialInfoList::iterator i;
+    MessageContext context;
+    
+    GetMessageContext(&context);
+    for (i = list.begin(); i != list.end(); ++i)
+        threads.push_back(std::thread(identifyPort, &*i, config, context));
+    for (int n = 0; n < (int)threads.size(); ++n)
+        threads[n].join();
+}
+
+/*
+ * With serialNumber only the port on the adapter with that USB serial number
+ * is listed. Otherwise ports on a Parallax adapter are listed first without
+ * opening them.
+ * With check the other ports are identified in parallel so the time taken
+ * doesn't grow with the number of adapters and only ports that answered are
+ * listed. If none did they are listed anyway so a board that can't answer
+ * with the default reset settings can still be tried.
+ */
+int SerialPropConnection::findPorts(const char *prefix, bool check, SerialInfoList &list, int count, const char *serialNumber)
+{
+    SerialInfoList candidates, others;
+    SerialInfoList::iterator i;
+    
+    SerialFind(prefix, addPort, &candidates);
+    
+    /* the board configuration names the adapter */
+    if (serialNumber) {
+        for (i = candidates.begin(); i != candidates.end(); ++i) {
+            if (strcmp(i->serialNumber(), serialNumber) == 0) {
+                message("Found adapter %s on %s", serialNumber, i->port());
+                list.push_back(*i);
+                if (--count == 0)
+                    break;
+            }
+        }
+        return 0;
+    }
+    
+    for (i = candidates.begin(); i != candidates.end(); ++i) {
+        if (i->isPropellerAdapter()) {
+            message("Found Propeller adapter %04x:%04x (%s) on %s", i->vid(), i->pid(), i->product(), i->port());
+            list.push_back(*i);
+            if (--count == 0)
+                return 0;
+        }
+        else
+            others.push_back(*i);
+    }
+    
+    if (check && !others.empty()) {
+        identifyPorts(others);
+        for (i = others.begin(); i != others.end(); ++i) {
+            if (i->version() == 1) {
+                message("Found Propeller on %s", i->port());
+                list.push_back(*i);
+                if (--count == 0)
+                    return 0;
+            }
+        }
+        if (!list.empty())
+            return 0;
+    }
+    
+    for (i = others.begin(); i != others.end(); ++i) {
+        list.push_back(*i);
+        if (--count == 0)
+            break;
+    }
+    
     return 0;
 }
 
@@ -67,6 +197,7 @@ int SerialPropConnection::close()
     if (!isOpen())
         return -1;
 
+    cancelLoad();
     CloseSerial(m_serialPort);
     m_serialPort = NULL;
 
@@ -87,10 +218,99 @@ int SerialPropConnection::generateResetSignal()
 {
     if (!isOpen())
         return -1;
+    cancelLoad();
     SerialGenerateResetSignal(m_serialPort);
     return 0;
 }
 
+int SerialPropConnection::setResetMethod(const char *method)
+{
+    char *copy;
+    int sts;
+    if (!isOpen())
+        return -1;
+    if (!(copy = strdup(method)))
+        return -1;
+    sts = SerialUseResetMethod(m_serialPort, copy);
+    free(copy);
+    return sts;
+}
+
+void SerialPropConnection::setResetDelay(int delay)
+{
+    if (isOpen())
+        SerialSetResetDelay(m_serialPort, delay);
+}
+
+void SerialPropConnection::setResetPulse(int pulse)
+{
+    if (isOpen())
+        SerialSetResetPulse(m_serialPort, pulse);
+}
+
+/* reset the Propeller and send the start of the handshake */
+int SerialPropConnection::resetAndSend(const uint8_t *buf, int len)
+{
+    if (!isOpen())
+        return -1;
+    
+    /* finish a reset started by startLoad */
+    if (m_resetThread.joinable()) {
+        m_resetThread.join();
+        if (m_resetStatus != 0)
+            return -1;
+        
+        /* the ROM only listens for a short time after reset so start over if the packet took too long to prepare */
+        if (std::chrono::steady_clock::now() - m_resetDone <= std::chrono::milliseconds(RESET_LATE_LIMIT))
+            return SendSerialData(m_serialPort, buf, len) == len ? 0 : -1;
+        message("Loader packet wasn't ready in time, resetting again");
+    }
+    
+    /* queue the packet to go out as soon as reset is released */
+    if (m_prequeueHandshake)
+        return SerialGenerateResetSignalAndSend(m_serialPort, buf, len);
+    
+    /* otherwise wait out the reset delay first */
+    SerialGenerateResetSignal(m_serialPort);
+    return SendSerialData(m_serialPort, buf, len) == len ? 0 : -1;
+}
+
+/* reset the Propeller while the caller reads the image and generates the loader packet */
+int SerialPropConnection::startLoad()
+{
+    MessageContext context;
+    
+    if (!isOpen())
+        return -1;
+    cancelLoad();
+    
+    /* switch to the loader baud rate now so loadImage doesn't touch the port during the reset */
+    if (setBaudRate(loaderBaudRate()) != 0)
+        return -1;
+    
+    /* a pre-queued handshake has to go out with the reset itself */
+    if (m_prequeueHandshake)
+        return 0;
+    
+    m_resetStatus = 0;
+    GetMessageContext(&context);
+    m_resetThread = std::thread(&SerialPropConnection::runReset, this, context);
+    return 0;
+}
+
+void SerialPropConnection::runReset(MessageContext context)
+{
+    SetMessageContext(&context);
+    m_resetStatus = SerialGenerateResetSignal(m_serialPort);
+    m_resetDone = std::chrono::steady_clock::now();
+}
+
+void SerialPropConnection::cancelLoad()
+{
+    if (m_resetThread.joinable())
+        m_resetThread.join();
+}
+
 int SerialPropConnection::sendData(const uint8_t *buf, int len)
 {
     if (!isOpen())
@@ -141,8 +361,8 @@ int SerialPropConnection::setBaudRate(int baudRate)
     return 0;
 }
 
-int SerialPropConnection::terminal(bool checkForExit, bool pstMode)
+int SerialPropConnection::terminal(const TerminalOptions *options)
 {
-    SerialTerminal(m_serialPort, checkForExit, pstMode);
+    SerialTerminal(m_serialPort, options);
     return 0;
 }
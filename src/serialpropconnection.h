@@ -3,8 +3,12 @@
 
 #include <string>
 #include <list>
+#include <thread>
+#include <chrono>
 #include "propconnection.h"
 #include "serial.h"
+#include "config.h"
+#include "proploader.h"
 
 #define SERIAL_LOADER_BAUD_RATE         115200
 #define SERIAL_FAST_LOADER_BAUD_RATE    921600
@@ -12,11 +16,28 @@
 
 class SerialInfo {
 public:
-    SerialInfo() {}
-    SerialInfo(std::string port) : m_port(port) {}
+    SerialInfo() : m_vid(0), m_pid(0), m_version(0), m_identifyTime(0) {}
+    SerialInfo(std::string port, const SerialPortInfo &info) : m_port(port), m_vid(info.vid), m_pid(info.pid), m_serialNumber(info.serialNumber), m_manufacturer(info.manufacturer), m_product(info.product), m_version(0), m_identifyTime(0) {}
     const char *port() { return m_port.c_str(); }
+    int vid() { return m_vid; }
+    int pid() { return m_pid; }
+    const char *serialNumber() { return m_serialNumber.c_str(); }
+    const char *manufacturer() { return m_manufacturer.c_str(); }
+    const char *product() { return m_product.c_str(); }
+    bool isPropellerAdapter();
+    // set by SerialPropConnection::identifyPorts (version is 0 if nothing answered)
+    int version() { return m_version; }
+    int identifyTime() { return m_identifyTime; }
+    void setIdentified(int version, int ms) { m_version = version; m_identifyTime = ms; }
 private:
     std::string m_port;
+    int m_vid;
+    int m_pid;
+    std::string m_serialNumber;
+    std::string m_manufacturer;
+    std::string m_product;
+    int m_version;
+    int m_identifyTime;     // milliseconds
 };
 
 typedef std::list<SerialInfo> SerialInfoList;
@@ -40,12 +61,33 @@ public:
     int receiveDataExactTimeout(uint8_t *buf, int len, int timeout);
     int setBaudRate(int baudRate);
     int maxDataSize() { return 1024; }
-    int terminal(bool checkForExit, bool pstMode);
-    static int findPorts(const char *prefix, bool check, SerialInfoList &list, int count = -1);
+    int terminal(const TerminalOptions *options);
+    int startLoad();
+    void cancelLoad();
+    int setResetMethod(const char *method);
+    void setResetDelay(int delay);
+    void setResetPulse(int pulse);
+    void setPrequeueHandshake(bool prequeue) { m_prequeueHandshake = prequeue; }
+    static int findPorts(const char *prefix, bool check, SerialInfoList &list, int count = -1, const char *serialNumber = NULL);
+    static void identifyPorts(SerialInfoList &list, BoardConfig *config = NULL);
 private:
     int receiveChecksumAck(int byteCount, int delay);
+    int receiveHandshake(int *pVersion, int byteCount);
+    int resetAndSend(const uint8_t *buf, int len);
+    void runReset(MessageContext context);
+    void freeLoaderPacket();
     static int addPort(const char *port, void *data);
+    static void identifyPort(SerialInfo *info, BoardConfig *config, MessageContext context);
     SERIAL *m_serialPort;
+    uint8_t *m_loaderImage;
+    int m_loaderImageSize;
+    LoadType m_loaderLoadType;
+    uint8_t *m_loaderPacket;
+    int m_loaderPacketSize;
+    bool m_prequeueHandshake;
+    std::thread m_resetThread;
+    int m_resetStatus;
+    std::chrono::steady_clock::time_point m_resetDone;  // when the reset delay ended
 };
 
 #endif // SERIALPROPELLERCONNECTION_H
@@ -1,6 +1,8 @@
 #ifndef __SOCK_H__
 #define __SOCK_H__
 
+#include "terminal.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -38,6 +40,14 @@ typedef struct {
     SOCKADDR_IN bcast;
 } IFADDR;
 
+/* per-socket tuning */
+typedef struct {
+    int noDelay;            /* disable Nagle's algorithm (TCP_NODELAY) */
+    int quickAck;           /* acknowledge immediately (TCP_QUICKACK where available) */
+    int sendBufferSize;     /* SO_SNDBUF or zero for the system default */
+    int receiveBufferSize;  /* SO_RCVBUF or zero for the system default */
+} SocketOptions;
+
 int GetInterfaceAddresses(IFADDR *addrs, int max);
 int GetInternetAddress(const char *hostName, short port, SOCKADDR_IN *addr);
 const char *AddrToString(uint32_t addr);
@@ -46,17 +56,21 @@ int OpenBroadcastSocket(short port, SOCKET *pSocket);
 int ConnectSocket(SOCKADDR_IN *addr, SOCKET *pSocket);
 int ConnectSocketTimeout(SOCKADDR_IN *addr, int timeout, SOCKET *pSocket);
 int BindSocket(short port, SOCKET *pSocket);
+int SetSocketOptions(SOCKET sock, const SocketOptions *options);
+void SocketQuickAck(SOCKET sock);
 void CloseSocket(SOCKET sock);
+void AbortSocket(SOCKET sock);
 int SocketDataAvailableP(SOCKET sock, int timeout);
 int SendSocketData(SOCKET sock, const void *buf, int len);
 int ReceiveSocketData(SOCKET sock, void *buf, int len);
 int ReceiveSocketDataTimeout(SOCKET sock, void *buf, int len, int timeout);
 int ReceiveSocketDataExactTimeout(SOCKET sock, void *buf, int len, int timeout);
+int SocketPartialReadCount(void);
 int SendSocketDataTo(SOCKET sock, const void *buf, int len, SOCKADDR_IN *addr);
 int ReceiveSocketDataFrom(SOCKET sock, void *buf, int len, SOCKADDR_IN *addr);
 int ReceiveSocketDataAndAddress(SOCKET sock, void *buf, int len, SOCKADDR_IN *addr);
 const char *AddressToString(SOCKADDR_IN *addr);
-void SocketTerminal(SOCKET sock, int check_for_exit, int pst_mode);
+void SocketTerminal(SOCKET sock, const TerminalOptions *options);
 
 #ifdef __cplusplus
 }
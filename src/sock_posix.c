@@ -15,6 +15,7 @@
 #endif
 
 #include "sock.h"
+#include "ioreactor.h"
 
 #ifdef __MINGW32__
 
@@ -159,9 +160,7 @@ int ConnectSocketTimeout(SOCKADDR_IN *addr, int timeout, SOCKET *pSocket)
 
     /* connect to the server */
     if (connect(sock, (SOCKADDR *)addr, sizeof(*addr)) != 0) {
-        struct timeval timeVal;
         socklen_t optLen;
-        fd_set sockets;
             
         /* fail on any error other than "in progress" */
         if (errno != EINPROGRESS) {
@@ -169,16 +168,8 @@ int ConnectSocketTimeout(SOCKADDR_IN *addr, int timeout, SOCKET *pSocket)
             return -1;
         }
         
-        /* setup the read socket set */
-        FD_ZERO(&sockets);
-        FD_SET(sock, &sockets);
-
-        /* setup the timeout */
-        timeVal.tv_sec = timeout / 1000;
-        timeVal.tv_usec = (timeout % 1000) * 1000;
-
         /* wait for the connect to complete or a timeout */
-        if (select(sock + 1, NULL, &sockets, NULL, &timeVal) <= 0 || !FD_ISSET(sock, &sockets)) {
+        if (IOWaitWritable(sock, IODeadline(timeout)) <= 0) {
             closesocket(sock);
             return -1;
         }
@@ -235,52 +226,77 @@ int BindSocket(short port, SOCKET *pSocket)
     return 0;
 }
 
-/* CloseSocket - close a socket */
+/* SetSocketOptions - tune a connected socket */
+int SetSocketOptions(SOCKET sock, const SocketOptions *options)
+{
+    int value, sts = 0;
+
+    value = options->noDelay ? 1 : 0;
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *)&value, sizeof(value)) != 0)
+        sts = -1;
+
+    if (options->quickAck)
+        SocketQuickAck(sock);
+
+    if ((value = options->sendBufferSize) > 0) {
+        if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (void *)&value, sizeof(value)) != 0)
+            sts = -1;
+    }
+
+    if ((value = options->receiveBufferSize) > 0) {
+        if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (void *)&value, sizeof(value)) != 0)
+            sts = -1;
+    }
+
+    return sts;
+}
+
+/* SocketQuickAck - acknowledge received data immediately (linux clears this after a while so re-arm it after receiving) */
+void SocketQuickAck(SOCKET sock)
+{
+#ifdef TCP_QUICKACK
+    int value = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, (void *)&value, sizeof(value));
+#endif
+}
+
+#ifdef __MINGW32__
+#define SHUT_WR SD_SEND
+#endif
+
+/* CloseSocket - close a socket without waiting for the peer to close its end */
 void CloseSocket(SOCKET sock)
 {
-    struct timeval tv;
-    fd_set sockets;
     char buf[512];
 
-    tv.tv_sec = 0;
-    tv.tv_usec = 1000;
-
-    /* wait for the close to complete */
-    for (;;) {
-        FD_ZERO(&sockets);
-        FD_SET(sock, &sockets);
-        if (select(sock + 1, &sockets, NULL, NULL, &tv) > 0) {
-            if (FD_ISSET(sock, &sockets))
-                if (recv(sock, buf, sizeof(buf), 0) == 0)
-                    break;
-        }
-        else
-            break;
-    }
+    /* send our FIN after any data still queued (fails harmlessly for datagram sockets) */
+    shutdown(sock, SHUT_WR);
+
+    /* discard anything that has already arrived so the close doesn't turn into a reset */
+    while (IOWaitReadable(sock, IODeadline(0)) > 0 && recv(sock, buf, sizeof(buf), 0) > 0)
+        ;
 
-    /* close the socket */
+    /* the system finishes the close handshake in the background */
     closesocket(sock);
 }
 
-/* SocketDataAvailableP - check for data being available on a socket */
-int SocketDataAvailableP(SOCKET sock, int timeout)
+/* AbortSocket - reset a connection immediately discarding any unsent data */
+void AbortSocket(SOCKET sock)
 {
-    struct timeval timeVal;
-    fd_set sockets;
-    int cnt;
+    struct linger linger;
 
-    /* setup the read socket set */
-    FD_ZERO(&sockets);
-    FD_SET(sock, &sockets);
+    linger.l_onoff = 1;
+    linger.l_linger = 0;
+    setsockopt(sock, SOL_SOCKET, SO_LINGER, (void *)&linger, sizeof(linger));
 
-    timeVal.tv_sec = timeout / 1000;
-    timeVal.tv_usec = (timeout % 1000) * 1000;
-
-    /* check for data available */
-    cnt = select(sock + 1, &sockets, NULL, NULL, timeout < 0 ? NULL : &timeVal);
+    closesocket(sock);
+}
 
-    /* return whether data is available */
-    return cnt > 0 && FD_ISSET(sock, &sockets);
+/* SocketDataAvailableP - check for data being available on a socket */
+int SocketDataAvailableP(SOCKET sock, int timeout)
+{
+    /* a negative timeout waits forever */
+    return IOWaitReadable(sock, IODeadline(timeout)) > 0;
 }
 
 /* SendSocketData - send socket data */
@@ -304,29 +320,44 @@ int ReceiveSocketData(SOCKET sock, void *buf, int len)
 /* ReceiveSocketDataTimeout - receive socket data */
 int ReceiveSocketDataTimeout(SOCKET sock, void *buf, int len, int timeout)
 {
-    struct timeval toval;
-    fd_set set;
+    if (IOWaitReadable(sock, IODeadline(timeout)) > 0)
+        return (int)recv(sock, buf, len, 0);
+    return -1;
+}
 
-    FD_ZERO(&set);
-    FD_SET(sock, &set);
+/* number of exact receives that arrived in more than one piece */
+static __thread int partialReadCount = 0;
 
-    toval.tv_sec = timeout / 1000;
-    toval.tv_usec = (timeout % 1000) * 1000;
+/* ReceiveSocketDataExactTimeout - receive an exact amount of socket data before a deadline */
+int ReceiveSocketDataExactTimeout(SOCKET sock, void *buf, int len, int timeout)
+{
+    int64_t deadline = IODeadline(timeout);
+    char *ptr = (char *)buf;
+    int remaining = len;
+    int reads = 0;
+    int cnt;
 
-    if (select(sock + 1, &set, NULL, NULL, &toval) > 0) {
-        if (FD_ISSET(sock, &set)) {
-            int bytes = (int)recv(sock, buf, len, 0);
-            return bytes;
-        }
+    /* the data may be split across several TCP segments */
+    while (remaining > 0) {
+        if (IOWaitReadable(sock, deadline) <= 0)
+            return -1;
+        if ((cnt = (int)recv(sock, ptr, remaining, 0)) <= 0)
+            return -1;
+        remaining -= cnt;
+        ptr += cnt;
+        ++reads;
     }
 
-    return -1;
+    if (reads > 1)
+        ++partialReadCount;
+
+    return len;
 }
 
-/* ReceiveSocketDataExactTimeout - receive an exact amount of socket data */
-int ReceiveSocketDataExactTimeout(SOCKET sock, void *buf, int len, int timeout)
+/* SocketPartialReadCount - get the number of exact receives that arrived in more than one piece */
+int SocketPartialReadCount(void)
 {
-    return ReceiveSocketDataTimeout(sock, buf, len, timeout);
+    return partialReadCount;
 }
 
 /* ReceiveSocketDataAndAddress - receive socket data and sender's address */
@@ -350,141 +381,62 @@ const char *AddressToString(SOCKADDR_IN *addr)
     return inet_ntoa(addr->sin_addr);
 }
 
-/* escape from terminal mode */
-#define ESC         0x1b
-
-/*
- * if "check_for_exit" is true, then
- * a sequence EXIT_CHAR 00 nn indicates that we should exit
- */
-#define EXIT_CHAR   0xff
-
-void SocketTerminal(SOCKET sock, int check_for_exit, int pst_mode)
+void SocketTerminal(SOCKET sock, const TerminalOptions *options)
 {
 #ifdef __MINGW32__
-    int sawexit_char = 0;
-    int sawexit_valid = 0;
-    int exitcode = 0;
-    int continue_terminal = 1;
-
-    while (continue_terminal) {
-        uint8_t buf[1];
-        if (ReceiveSocketDataTimeout(sock, buf, 1, 0) != -1) {
-            if (sawexit_valid) {
-                exitcode = buf[0];
-                continue_terminal = 0;
-            }
-            else if (sawexit_char) {
-                if (buf[0] == 0) {
-                    sawexit_valid = 1;
-                } else {
-                    putchar(EXIT_CHAR);
-                    putchar(buf[0]);
-                    fflush(stdout);
-                }
-            }
-            else if (check_for_exit && buf[0] == EXIT_CHAR) {
-                sawexit_char = 1;
-            }
-            else {
-                putchar(buf[0]);
-                if (pst_mode && buf[0] == '\r')
-                    putchar('\n');
-                fflush(stdout);
+    uint8_t *buf, *out = NULL;
+    TerminalFilter filter;
+    FILE *capture = NULL;
+    int display, cnt;
+
+    if (!(buf = (uint8_t *)malloc(TERMINAL_BUFFER_SIZE)))
+        return;
+    if (TerminalFilterNeeded(options) && !(out = (uint8_t *)malloc(TERMINAL_BUFFER_SIZE * TERMINAL_FILTER_EXPANSION))) {
+        free(buf);
+        return;
+    }
+    if (options->captureFile && !(capture = fopen(options->captureFile, "wb"))) {
+        printf("error: can't create capture file '%s'\n", options->captureFile);
+        free(out);
+        free(buf);
+        return;
+    }
+    display = !(options->headless && capture);
+    TerminalFilterInit(&filter, options);
+
+    while (!filter.done) {
+
+        /* take everything that has arrived rather than a byte at a time */
+        if ((cnt = ReceiveSocketDataTimeout(sock, buf, TERMINAL_BUFFER_SIZE, options->headless ? -1 : 10)) > 0) {
+            if (capture)
+                fwrite(buf, 1, cnt, capture);
+            if (out) {
+                cnt = TerminalFilterProcess(&filter, buf, cnt, out);
+                if (display)
+                    fwrite(out, 1, cnt, stdout);
             }
+            else if (display)
+                fwrite(buf, 1, cnt, stdout);
+            fflush(stdout);
         }
-        else if (kbhit()) {
-            if ((buf[0] = getch()) == ESC)
+        else if (cnt == 0 || (cnt < 0 && options->headless))
+            break;
+        else if (!options->headless && kbhit()) {
+            if ((buf[0] = getch()) == TERMINAL_ESC)
                 break;
             SendSocketData(sock, buf, 1);
         }
     }
 
-    if (check_for_exit && sawexit_valid) {
-        exit(exitcode);
-    }
-#else
-    struct termios oldt, newt;
-    char buf[128], realbuf[256]; // double in case buf is filled with \r in PST mode
-    ssize_t cnt;
-    fd_set set;
-    int exit_char = 0xdead; /* not a valid character */
-    int sawexit_char = 0;
-    int sawexit_valid = 0; 
-    int exitcode = 0;
-    int continue_terminal = 1;
-
-    tcgetattr(STDIN_FILENO, &oldt);
-    newt = oldt;
-    newt.c_lflag &= ~(ICANON | ECHO | ISIG);
-    newt.c_iflag &= ~(ICRNL | INLCR);
-    newt.c_oflag &= ~OPOST;
-    tcsetattr(STDIN_FILENO, TCSANOW, &newt);
-
-    if (check_for_exit)
-        exit_char = EXIT_CHAR;
-
-#if 0
-    /* make it possible to detect breaks */
-    tcgetattr(sock, &newt);
-    newt.c_iflag &= ~IGNBRK;
-    newt.c_iflag |= PARMRK;
-    tcsetattr(sock, TCSANOW, &newt);
-#endif
-
-    do {
-        FD_ZERO(&set);
-        FD_SET(sock, &set);
-        FD_SET(STDIN_FILENO, &set);
-        if (select(sock + 1, &set, NULL, NULL, NULL) > 0) {
-            if (FD_ISSET(sock, &set)) {
-                if ((cnt = recv(sock, buf, sizeof(buf), 0)) > 0) {
-                    int i;
-                    // check for breaks
-                    ssize_t realbytes = 0;
-                    for (i = 0; i < cnt; i++) {
-                      if (sawexit_valid)
-                        {
-                          exitcode = buf[i];
-                          continue_terminal = 0;
-                        }
-                      else if (sawexit_char) {
-                        if (buf[i] == 0) {
-                          sawexit_valid = 1;
-                        } else {
-                          realbuf[realbytes++] = exit_char;
-                          realbuf[realbytes++] = buf[i];
-                          sawexit_char = 0;
-                        }
-                      } else if (((int)buf[i] & 0xff) == exit_char) {
-                        sawexit_char = 1;
-                      } else {
-                        realbuf[realbytes++] = buf[i];
-                        if (pst_mode && buf[i] == '\r')
-                            realbuf[realbytes++] = '\n';
-                      }
-                    }
-                    write(fileno(stdout), realbuf, realbytes);
-                }
-            }
-            if (FD_ISSET(STDIN_FILENO, &set)) {
-                if ((cnt = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
-                    int i;
-                    for (i = 0; i < cnt; ++i) {
-                        if (buf[i] == ESC)
-                            goto done;
-                    }
-                    write(sock, buf, cnt);
-                }
-            }
-        }
-    } while (continue_terminal);
+    if (capture)
+        fclose(capture);
+    free(out);
+    free(buf);
 
-done:
-    tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
-
-    if (sawexit_valid)
-        exit(exitcode);
+    if (filter.sawExitValid)
+        exit(filter.exitCode);
+#else
+    TerminalRun(sock, 1, options);
 #endif
 }
 
@@ -572,3 +524,149 @@ int StringToAddr(const char *addr, uint32_t *pAddr)
     return 0;
 }
 
+
+#ifdef TEST_SOCK
+
+/*
+   Loopback benchmark for the telnet socket options. A stand-in for the
+   module's telnet port answers each packet with an 8 byte response the
+   way the fast loader's receiver does and the round trips are timed with
+   the default options and with the latency profile. Each packet is sent
+   whole the way the fast loader sends it and then split into its 8 byte
+   header and payload, the write-write-read pattern where Nagle and
+   delayed ACKs stall. The stand-in can clamp its MSS to that of a real
+   network so packets larger than one segment are split as they would be
+   on the way to a module.
+
+   gcc -Wall -DLINUX -DTEST_SOCK src/sock_posix.c src/ioreactor.c src/terminal.c -lpthread -o sockbench
+   sockbench [packet-size [count [mss]]]
+*/
+
+#include <pthread.h>
+
+#define BENCH_HEADER_SIZE   8
+#define BENCH_RESPONSE_SIZE 8
+#define BENCH_TIMEOUT       5000
+#define BENCH_CONNECTIONS   4
+
+typedef struct {
+    SOCKET listener;
+    int packetSize;
+} BenchServer;
+
+static void *BenchServerThread(void *data)
+{
+    BenchServer *server = (BenchServer *)data;
+    uint8_t *packet, response[BENCH_RESPONSE_SIZE];
+    SOCKET sock;
+    int i;
+
+    if (!(packet = malloc(server->packetSize)))
+        return NULL;
+    memset(response, 0, sizeof(response));
+
+    /* answer every packet on each connection until the client closes it */
+    for (i = 0; i < BENCH_CONNECTIONS; ++i) {
+        if ((sock = accept(server->listener, NULL, NULL)) < 0)
+            break;
+        while (ReceiveSocketDataExactTimeout(sock, packet, server->packetSize, BENCH_TIMEOUT) == server->packetSize)
+            SendSocketData(sock, response, sizeof(response));
+        CloseSocket(sock);
+    }
+
+    free(packet);
+    return NULL;
+}
+
+static int RunBench(const char *name, SOCKADDR_IN *addr, const SocketOptions *options, int packetSize, int count, int split)
+{
+    uint8_t *packet, response[BENCH_RESPONSE_SIZE];
+    int64_t start, elapsed;
+    SOCKET sock;
+    int i;
+
+    if (!(packet = malloc(packetSize)))
+        return -1;
+    memset(packet, 0x55, packetSize);
+
+    if (ConnectSocket(addr, &sock) != 0) {
+        printf("%s: connect failed\n", name);
+        free(packet);
+        return -1;
+    }
+    if (options && SetSocketOptions(sock, options) != 0)
+        printf("%s: setting socket options failed\n", name);
+
+    start = IOTimeNow();
+    for (i = 0; i < count; ++i) {
+        if ((split
+            ? SendSocketData(sock, packet, BENCH_HEADER_SIZE) != BENCH_HEADER_SIZE
+              || SendSocketData(sock, packet + BENCH_HEADER_SIZE, packetSize - BENCH_HEADER_SIZE) != packetSize - BENCH_HEADER_SIZE
+            : SendSocketData(sock, packet, packetSize) != packetSize)
+        ||  ReceiveSocketDataExactTimeout(sock, response, sizeof(response), BENCH_TIMEOUT) != sizeof(response)) {
+            printf("%s: packet %d failed\n", name, i);
+            break;
+        }
+        if (options && options->quickAck)
+            SocketQuickAck(sock);
+    }
+    elapsed = IOTimeNow() - start;
+
+    printf("%-8s %-6s %d packets of %d bytes in %d ms (%.3f ms each)\n", name, split ? "split" : "whole", i, packetSize, (int)elapsed, i ? (double)elapsed / i : 0.0);
+
+    CloseSocket(sock);
+    free(packet);
+    return i == count ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    /* same profile as the wifi telnet connection */
+    static const SocketOptions latency = { 1, 1, 16 * 1024, 0 };
+    int packetSize = argc > 1 ? atoi(argv[1]) : 1032;
+    int count = argc > 2 ? atoi(argv[2]) : 200;
+    int mss = argc > 3 ? atoi(argv[3]) : 1460;
+    socklen_t addrLen = sizeof(SOCKADDR_IN);
+    BenchServer server;
+    SOCKADDR_IN addr;
+    pthread_t thread;
+    int sts = 0, split;
+
+    if (packetSize <= BENCH_HEADER_SIZE) {
+        printf("error: packets must be larger than their %d byte header\n", BENCH_HEADER_SIZE);
+        return 1;
+    }
+
+    /* listen on an ephemeral loopback port */
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((server.listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0
+    ||  (mss > 0 && setsockopt(server.listener, IPPROTO_TCP, TCP_MAXSEG, (void *)&mss, sizeof(mss)) != 0)
+    ||  bind(server.listener, (SOCKADDR *)&addr, sizeof(addr)) != 0
+    ||  listen(server.listener, BENCH_CONNECTIONS) != 0
+    ||  getsockname(server.listener, (SOCKADDR *)&addr, &addrLen) != 0) {
+        printf("error: can't listen on loopback\n");
+        return 1;
+    }
+    server.packetSize = packetSize;
+    if (pthread_create(&thread, NULL, BenchServerThread, &server) != 0) {
+        printf("error: can't start the stand-in\n");
+        return 1;
+    }
+
+    printf("mss %d\n", mss);
+    for (split = 0; split <= 1; ++split) {
+        if (RunBench("default", &addr, NULL, packetSize, count, split) != 0)
+            sts = 1;
+        if (RunBench("latency", &addr, &latency, packetSize, count, split) != 0)
+            sts = 1;
+    }
+
+    pthread_join(thread, NULL);
+    CloseSocket(server.listener);
+
+    return sts;
+}
+
+#endif // TEST_SOCK
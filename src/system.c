@@ -23,6 +23,7 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <dirent.h>
 #include "system.h"
 
 #if defined(WIN32)
@@ -41,39 +42,78 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 typedef struct PathEntry PathEntry;
 struct PathEntry {
     PathEntry *next;
+    int index;          /* state of the directory listing */
+    int count;          /* number of names in the directory */
+    char **names;       /* sorted names in the directory */
     char path[1];
 };
 
-static PathEntry *path = NULL;
-static PathEntry **pNextPathEntry = &path;
+/* directory listing states */
+#define INDEX_NONE      0   /* not listed yet */
+#define INDEX_VALID     1   /* names holds the directory listing */
+#define INDEX_MISSING   2   /* the directory couldn't be read so it holds nothing */
+#define INDEX_FAILED    3   /* out of memory so try opening files as before */
 
+/*
+   The listings are compared ignoring case everywhere. Whether a directory
+   is case sensitive depends on the file system it is on rather than the
+   OS (a vfat or CIFS mount on Linux isn't) so a miss is only certain if no
+   name matches in any case. A name that only matches in a different case
+   is tried with fopen, which gives the file system's answer.
+*/
+#define CompareFileNames(a, b)  strcasecmp(a, b)
+
+/* each thread has its own include path so loads on different threads don't interfere */
+static __thread PathEntry *path = NULL;
+static __thread PathEntry **pNextPathEntry = NULL;
+
+static PathEntry *NewPathEntry(const char *path, int len);
+static void FreePathEntry(PathEntry *entry);
+static void AppendPathEntry(PathEntry *entry);
+static int MayContainFile(PathEntry *entry, const char *name);
+static void IndexPathEntry(PathEntry *entry);
+static int CompareNames(const void *a, const void *b);
 static const char *MakePath(PathEntry *entry, const char *name);
 
+/* xbOpenFileInPath - open a file in the current directory or the first directory in the path that has it */
 FILE *xbOpenFileInPath(const char *name, const char *mode)
 {
     PathEntry *entry;
+    const char *fullpath;
     FILE *fp;
     
     if (!(fp = fopen(name, mode))) {
-        for (entry = path; entry != NULL; entry = entry->next)
-            if ((fp = fopen(MakePath(entry, name), mode)) != NULL)
+        for (entry = path; entry != NULL; entry = entry->next) {
+            if (*mode == 'r' && !MayContainFile(entry, name))
+                continue;
+            if ((fullpath = MakePath(entry, name)) != NULL && (fp = fopen(fullpath, mode)) != NULL)
                 break;
+        }
     }
     return fp;
 }
 
 int xbAddPath(const char *path)
 {
-    PathEntry *entry = malloc(sizeof(PathEntry) + strlen(path));
-    if (!(entry))
+    PathEntry *entry;
+    if (!(entry = NewPathEntry(path, strlen(path))))
         return FALSE;
-    strcpy(entry->path, path);
-    *pNextPathEntry = entry;
-    pNextPathEntry = &entry->next;
-    entry->next = NULL;
+    AppendPathEntry(entry);
     return TRUE;
 }
 
+/* xbClearPath - empty the include path so it can be rebuilt for another load */
+void xbClearPath(void)
+{
+    PathEntry *entry, *next;
+    for (entry = path; entry != NULL; entry = next) {
+        next = entry->next;
+        FreePathEntry(entry);
+    }
+    path = NULL;
+    pNextPathEntry = &path;
+}
+
 int xbAddFilePath(const char *name)
 {
     PathEntry *entry;
@@ -82,13 +122,9 @@ int xbAddFilePath(const char *name)
     if (!(end = strrchr(name, DIR_SEP)))
         return FALSE;
     len = (int)(end - name);
-    if (!(entry  = malloc(sizeof(PathEntry) + len)))
+    if (!(entry = NewPathEntry(name, len)))
         return FALSE;
-    strncpy(entry->path, name, len);
-    entry->path[len] = '\0';
-    *pNextPathEntry = entry;
-    pNextPathEntry = &entry->next;
-    entry->next = NULL;
+    AppendPathEntry(entry);
     return TRUE;
 }
 
@@ -154,26 +190,269 @@ int xbAddProgramPath(char *argv[])
 
 int xbAddEnvironmentPath(const char *name)
 {
-    char *p, *end;
+    char *value, *p, *end;
+    int sts = TRUE;
     
-    /* add path entries from the environment */
-    if ((p = getenv(name)) != NULL) {
+    /* add path entries from the environment without modifying it so this can be done more than once */
+    if ((value = getenv(name)) != NULL) {
+        if (!(p = value = strdup(value)))
+            return FALSE;
         while ((end = strchr(p, PATH_SEP)) != NULL) {
             *end = '\0';
-            if (!xbAddPath(p))
-                return FALSE;
+            if (!xbAddPath(p)) {
+                sts = FALSE;
+                break;
+            }
             p = end + 1;
         }
-        if (!xbAddPath(p))
-            return FALSE;
+        if (sts && !xbAddPath(p))
+            sts = FALSE;
+        free(value);
     }
     
+    return sts;
+}
+
+static PathEntry *NewPathEntry(const char *path, int len)
+{
+    PathEntry *entry;
+    if (!(entry = malloc(sizeof(PathEntry) + len)))
+        return NULL;
+    memset(entry, 0, sizeof(PathEntry));
+    strncpy(entry->path, path, len);
+    entry->path[len] = '\0';
+    return entry;
+}
+
+static void FreePathEntry(PathEntry *entry)
+{
+    int i;
+    for (i = 0; i < entry->count; ++i)
+        free(entry->names[i]);
+    free(entry->names);
+    free(entry);
+}
+
+static void AppendPathEntry(PathEntry *entry)
+{
+    if (!pNextPathEntry)
+        pNextPathEntry = &path;
+    *pNextPathEntry = entry;
+    pNextPathEntry = &entry->next;
+    entry->next = NULL;
+}
+
+/*
+   Each directory in the path is listed the first time a file is looked up
+   in it and the sorted listing answers every later lookup during the same
+   load. That replaces a failed open in each directory for each lookup with
+   one listing per directory, which matters when PROPELLER_LOAD_PATH points
+   at network mounts, and a directory that doesn't exist costs nothing after
+   the first lookup. The listings are dropped by xbClearPath so each load
+   sees the directories as they are when it starts.
+*/
+
+/* MayContainFile - check the directory listing for a file */
+static int MayContainFile(PathEntry *entry, const char *name)
+{
+    /* names with directory parts can't be checked against the listing */
+    if (strchr(name, '/') || strchr(name, DIR_SEP))
+        return TRUE;
+    if (entry->index == INDEX_NONE)
+        IndexPathEntry(entry);
+    switch (entry->index) {
+    case INDEX_VALID:
+        return entry->count > 0 && bsearch(&name, entry->names, entry->count, sizeof(char *), CompareNames) != NULL;
+    case INDEX_MISSING:
+        return FALSE;
+    }
     return TRUE;
 }
 
+/* IndexPathEntry - list the names in a path directory */
+static void IndexPathEntry(PathEntry *entry)
+{
+    struct dirent *dirent;
+    int maxCount = 0;
+    char **names;
+    DIR *dir;
+    
+    if (!(dir = opendir(entry->path))) {
+        entry->index = INDEX_MISSING;
+        return;
+    }
+    
+    while ((dirent = readdir(dir)) != NULL) {
+        if (entry->count >= maxCount) {
+            maxCount = maxCount ? maxCount * 2 : 64;
+            if (!(names = realloc(entry->names, maxCount * sizeof(char *))))
+                break;
+            entry->names = names;
+        }
+        if (!(entry->names[entry->count] = strdup(dirent->d_name)))
+            break;
+        ++entry->count;
+    }
+    closedir(dir);
+    
+    /* stopping early means memory ran out */
+    if (dirent) {
+        while (entry->count > 0)
+            free(entry->names[--entry->count]);
+        free(entry->names);
+        entry->names = NULL;
+        entry->index = INDEX_FAILED;
+        return;
+    }
+    
+    if (entry->count > 1)
+        qsort(entry->names, entry->count, sizeof(char *), CompareNames);
+    entry->index = INDEX_VALID;
+}
+
+static int CompareNames(const void *a, const void *b)
+{
+    return CompareFileNames(*(const char **)a, *(const char **)b);
+}
+
 static const char *MakePath(PathEntry *entry, const char *name)
 {
-    static char fullpath[PATH_MAX];
-    sprintf(fullpath, "%s%c%s", entry->path, DIR_SEP, name);
+    static __thread char fullpath[PATH_MAX];
+    if (snprintf(fullpath, sizeof(fullpath), "%s%c%s", entry->path, DIR_SEP, name) >= (int)sizeof(fullpath))
+        return NULL;
     return fullpath;
 }
+
+#ifdef TEST_PATH
+
+/*
+   Times lookups over a PROPELLER_LOAD_PATH with several directories, first
+   with a failed open in each directory the way xbOpenFileInPath used to
+   look and then with the directory listings. The path is built in a
+   scratch directory with files at the end of it plus a directory that
+   doesn't exist, and half of the lookups are for names that aren't on the
+   path at all the way board configuration lookups often are. Each load
+   clears the path so the listing cost is paid once per load.
+
+   gcc -Wall -DLINUX -DTEST_PATH src/system.c -o pathbench
+   pathbench [loads [lookups-per-load [directories [files-per-directory]]]]
+*/
+
+#include <time.h>
+#include <sys/stat.h>
+
+static double BenchTime(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* the old lookup: try to open the name in each directory */
+static FILE *OpenFileInPathByWalking(const char *name, const char *mode)
+{
+    PathEntry *entry;
+    const char *fullpath;
+    FILE *fp;
+    
+    if (!(fp = fopen(name, mode))) {
+        for (entry = path; entry != NULL; entry = entry->next) {
+            if ((fullpath = MakePath(entry, name)) != NULL && (fp = fopen(fullpath, mode)) != NULL)
+                break;
+        }
+    }
+    return fp;
+}
+
+static double RunLoads(FILE *(*open)(const char *name, const char *mode), int loads, int lookups, int *pFound)
+{
+    char name[32];
+    double start;
+    FILE *fp;
+    int i, j;
+    
+    *pFound = 0;
+    start = BenchTime();
+    for (i = 0; i < loads; ++i) {
+        xbClearPath();
+        xbAddEnvironmentPath("PROPELLER_LOAD_PATH");
+        for (j = 0; j < lookups; ++j) {
+            if (j & 1)
+                snprintf(name, sizeof(name), "missing%d.cfg", j);
+            else
+                snprintf(name, sizeof(name), "board%d.cfg", j / 2);
+            if ((fp = (*open)(name, "r")) != NULL) {
+                ++*pFound;
+                fclose(fp);
+            }
+        }
+    }
+    return BenchTime() - start;
+}
+
+int main(int argc, char *argv[])
+{
+    int loads = argc > 1 ? atoi(argv[1]) : 1000;
+    int lookups = argc > 2 ? atoi(argv[2]) : 20;
+    int dirs = argc > 3 ? atoi(argv[3]) : 8;
+    int files = argc > 4 ? atoi(argv[4]) : 50;
+    char root[] = "/tmp/pathbenchXXXXXX", dir[PATH_MAX], file[PATH_MAX + 32];
+    char *loadPath, *p;
+    int oldFound, newFound, i, j;
+    double oldTime, newTime;
+    FILE *fp;
+    
+    if (!mkdtemp(root)) {
+        printf("error: can't create a scratch directory\n");
+        return 1;
+    }
+    
+    /* lookups in the current directory fail the same way for both */
+    if (chdir(root) != 0) {
+        printf("error: can't change to '%s'\n", root);
+        return 1;
+    }
+    
+    /* dirs directories of unrelated files, the boards in the last one, and one that doesn't exist */
+    if (!(p = loadPath = malloc((dirs + 1) * (strlen(root) + 16))))
+        return 1;
+    for (i = 0; i < dirs; ++i) {
+        snprintf(dir, sizeof(dir), "%s/dir%d", root, i);
+        mkdir(dir, 0700);
+        for (j = 0; j < files; ++j) {
+            if (i == dirs - 1)
+                snprintf(file, sizeof(file), "%s/board%d.cfg", dir, j);
+            else
+                snprintf(file, sizeof(file), "%s/other%d.spin", dir, j);
+            if ((fp = fopen(file, "w")) != NULL)
+                fclose(fp);
+        }
+        p += sprintf(p, "%s%c", dir, PATH_SEP);
+    }
+    sprintf(p, "%s/nowhere", root);
+    setenv("PROPELLER_LOAD_PATH", loadPath, 1);
+    
+    printf("%d loads of %d lookups, %d directories of %d files and one missing directory\n", loads, lookups, dirs, files);
+    oldTime = RunLoads(OpenFileInPathByWalking, loads, lookups, &oldFound);
+    newTime = RunLoads(xbOpenFileInPath, loads, lookups, &newFound);
+    printf("open in each directory: %8.2f us per lookup (%d found)\n", oldTime * 1e6 / ((double)loads * lookups), oldFound);
+    printf("directory listings:     %8.2f us per lookup (%d found)\n", newTime * 1e6 / ((double)loads * lookups), newFound);
+    xbClearPath();
+    
+    /* remove the scratch tree */
+    for (i = 0; i < dirs; ++i) {
+        for (j = 0; j < files; ++j) {
+            snprintf(file, sizeof(file), "%s/dir%d/%s%d.%s", root, i, i == dirs - 1 ? "board" : "other", j, i == dirs - 1 ? "cfg" : "spin");
+            remove(file);
+        }
+        snprintf(dir, sizeof(dir), "%s/dir%d", root, i);
+        rmdir(dir);
+    }
+    if (chdir("/") == 0)
+        rmdir(root);
+    free(loadPath);
+    
+    return oldFound == newFound ? 0 : 1;
+}
+
+#endif // TEST_PATH
@@ -44,6 +44,7 @@ extern "C" {
 #endif
 
 int xbAddPath(const char *path);
+void xbClearPath(void);
 int xbAddFilePath(const char *name);
 int xbAddEnvironmentPath(const char *name);
 int xbAddProgramPath(char *argv[]);
@@ -0,0 +1,407 @@
+#ifdef LINUX
+#define _GNU_SOURCE     /* for splice */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#ifndef __MINGW32__
+#include <unistd.h>
+#include <termios.h>
+#include <pthread.h>
+#endif
+
+#include "terminal.h"
+#include "ioreactor.h"
+
+/* display output that can be waiting for a slow console before the receive loop has to wait */
+#define TERMINAL_RING_SIZE      (4 * 1024 * 1024)
+
+/* pipe size used to move received data straight to the capture file */
+#define TERMINAL_PIPE_SIZE      (1024 * 1024)
+
+void TerminalFilterInit(TerminalFilter *filter, const TerminalOptions *options)
+{
+    filter->options = options;
+    filter->sawExitChar = 0;
+    filter->sawExitValid = 0;
+    filter->exitCode = 0;
+    filter->done = 0;
+    filter->atLineStart = 1;
+    filter->startTime = IOTimeNow();
+}
+
+/* without any of these options the received data is displayed as is */
+int TerminalFilterNeeded(const TerminalOptions *options)
+{
+    return options->checkForExit || options->pstMode || options->timestamps;
+}
+
+static uint8_t *Emit(TerminalFilter *filter, uint8_t *out, int ch)
+{
+    if (filter->options->timestamps && filter->atLineStart) {
+        int64_t elapsed = IOTimeNow() - filter->startTime;
+        out += sprintf((char *)out, "[%5ld.%03d] ", (long)(elapsed / 1000), (int)(elapsed % 1000));
+        filter->atLineStart = 0;
+    }
+    *out++ = ch;
+    if (ch == '\n')
+        filter->atLineStart = 1;
+    return out;
+}
+
+/* out must have room for len * TERMINAL_FILTER_EXPANSION bytes */
+int TerminalFilterProcess(TerminalFilter *filter, const uint8_t *in, int len, uint8_t *out)
+{
+    uint8_t *start = out;
+    int i;
+
+    for (i = 0; i < len && !filter->done; ++i) {
+        if (filter->sawExitValid) {
+            filter->exitCode = in[i];
+            filter->done = 1;
+        }
+        else if (filter->sawExitChar) {
+            if (in[i] == 0)
+                filter->sawExitValid = 1;
+            else {
+                out = Emit(filter, out, TERMINAL_EXIT_CHAR);
+                out = Emit(filter, out, in[i]);
+                filter->sawExitChar = 0;
+            }
+        }
+        else if (filter->options->checkForExit && in[i] == TERMINAL_EXIT_CHAR)
+            filter->sawExitChar = 1;
+        else {
+            out = Emit(filter, out, in[i]);
+            if (filter->options->pstMode && in[i] == '\r')
+                out = Emit(filter, out, '\n');
+        }
+    }
+
+    return (int)(out - start);
+}
+
+#ifndef __MINGW32__
+
+/*
+   Data from the target is read in large blocks and written to the
+   capture file as soon as it arrives. Display output goes through a
+   ring drained by a separate thread so a slow console never holds up
+   the receive loop long enough for the serial driver to drop data.
+*/
+
+typedef struct {
+    uint8_t *buf;
+    size_t head;                /* total bytes added */
+    size_t tail;                /* total bytes written */
+    int stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t data;        /* signalled when bytes are added or the writer should stop */
+    pthread_cond_t space;       /* signalled when bytes have been written */
+    pthread_t thread;
+} DisplayRing;
+
+typedef struct {
+    int fd;
+    const TerminalOptions *options;
+    TerminalFilter filter;
+    int filterNeeded;
+    uint8_t *inBuf;
+    uint8_t *outBuf;
+    int captureFd;
+    DisplayRing *display;
+    int continueTerminal;
+} TerminalState;
+
+static int WriteAll(int fd, const uint8_t *buf, size_t len)
+{
+    ssize_t cnt;
+    while (len > 0) {
+        if ((cnt = write(fd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += cnt;
+        len -= cnt;
+    }
+    return 0;
+}
+
+static void *DisplayWriter(void *data)
+{
+    DisplayRing *ring = (DisplayRing *)data;
+    size_t offset, len;
+
+    pthread_mutex_lock(&ring->mutex);
+    for (;;) {
+        while (ring->head == ring->tail && !ring->stop)
+            pthread_cond_wait(&ring->data, &ring->mutex);
+        if (ring->head == ring->tail)
+            break;
+
+        /* write the contiguous bytes up to the end of the ring without holding the lock */
+        offset = ring->tail % TERMINAL_RING_SIZE;
+        len = ring->head - ring->tail;
+        if (len > TERMINAL_RING_SIZE - offset)
+            len = TERMINAL_RING_SIZE - offset;
+        pthread_mutex_unlock(&ring->mutex);
+        WriteAll(STDOUT_FILENO, ring->buf + offset, len);
+        pthread_mutex_lock(&ring->mutex);
+
+        ring->tail += len;
+        pthread_cond_signal(&ring->space);
+    }
+    pthread_mutex_unlock(&ring->mutex);
+
+    return NULL;
+}
+
+static DisplayRing *DisplayOpen(void)
+{
+    DisplayRing *ring;
+
+    if (!(ring = (DisplayRing *)malloc(sizeof(DisplayRing))))
+        return NULL;
+    if (!(ring->buf = (uint8_t *)malloc(TERMINAL_RING_SIZE))) {
+        free(ring);
+        return NULL;
+    }
+    ring->head = ring->tail = 0;
+    ring->stop = 0;
+    pthread_mutex_init(&ring->mutex, NULL);
+    pthread_cond_init(&ring->data, NULL);
+    pthread_cond_init(&ring->space, NULL);
+
+    if (pthread_create(&ring->thread, NULL, DisplayWriter, ring) != 0) {
+        free(ring->buf);
+        free(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+static void DisplayPut(DisplayRing *ring, const uint8_t *buf, size_t len)
+{
+    size_t offset, chunk;
+
+    pthread_mutex_lock(&ring->mutex);
+    while (len > 0) {
+        while (ring->head - ring->tail == TERMINAL_RING_SIZE)
+            pthread_cond_wait(&ring->space, &ring->mutex);
+        offset = ring->head % TERMINAL_RING_SIZE;
+        chunk = TERMINAL_RING_SIZE - (ring->head - ring->tail);
+        if (chunk > TERMINAL_RING_SIZE - offset)
+            chunk = TERMINAL_RING_SIZE - offset;
+        if (chunk > len)
+            chunk = len;
+        memcpy(ring->buf + offset, buf, chunk);
+        ring->head += chunk;
+        buf += chunk;
+        len -= chunk;
+        pthread_cond_signal(&ring->data);
+    }
+    pthread_mutex_unlock(&ring->mutex);
+}
+
+/* write everything that's waiting and stop the writer */
+static void DisplayClose(DisplayRing *ring)
+{
+    pthread_mutex_lock(&ring->mutex);
+    ring->stop = 1;
+    pthread_cond_signal(&ring->data);
+    pthread_mutex_unlock(&ring->mutex);
+    pthread_join(ring->thread, NULL);
+    pthread_cond_destroy(&ring->space);
+    pthread_cond_destroy(&ring->data);
+    pthread_mutex_destroy(&ring->mutex);
+    free(ring->buf);
+    free(ring);
+}
+
+static void TerminalTargetHandler(IOReactor *reactor, int fd, int events, void *data)
+{
+    TerminalState *state = (TerminalState *)data;
+    ssize_t cnt;
+
+    if ((cnt = read(fd, state->inBuf, TERMINAL_BUFFER_SIZE)) <= 0) {
+        if (cnt < 0 && (errno == EINTR || errno == EAGAIN))
+            return;
+        state->continueTerminal = 0;
+        return;
+    }
+
+    /* the capture file gets exactly what was received */
+    if (state->captureFd >= 0 && WriteAll(state->captureFd, state->inBuf, cnt) != 0) {
+        printf("error: can't write capture file: %s\n", strerror(errno));
+        state->continueTerminal = 0;
+        return;
+    }
+
+    if (state->filterNeeded) {
+        int outCnt = TerminalFilterProcess(&state->filter, state->inBuf, cnt, state->outBuf);
+        if (state->display)
+            DisplayPut(state->display, state->outBuf, outCnt);
+        if (state->filter.done)
+            state->continueTerminal = 0;
+    }
+    else if (state->display)
+        DisplayPut(state->display, state->inBuf, cnt);
+}
+
+static void TerminalKeyboardHandler(IOReactor *reactor, int fd, int events, void *data)
+{
+    TerminalState *state = (TerminalState *)data;
+    uint8_t buf[128];
+    ssize_t cnt;
+
+    if ((cnt = read(fd, buf, sizeof(buf))) > 0) {
+        int i;
+        for (i = 0; i < cnt; ++i) {
+            if (buf[i] == TERMINAL_ESC) {
+                state->continueTerminal = 0;
+                return;
+            }
+        }
+        WriteAll(state->fd, buf, cnt);
+    }
+}
+
+#ifdef LINUX
+
+/* move socket data to the capture file inside the kernel (returns -1 if splice can't be used) */
+static int SpliceCapture(int fd, int captureFd)
+{
+    int pipeFds[2], first = 1;
+    ssize_t cnt, moved;
+
+    if (pipe(pipeFds) != 0)
+        return -1;
+    fcntl(pipeFds[1], F_SETPIPE_SZ, TERMINAL_PIPE_SIZE);
+
+    for (;;) {
+        if ((cnt = splice(fd, NULL, pipeFds[1], NULL, TERMINAL_PIPE_SIZE, SPLICE_F_MOVE)) <= 0) {
+            if (cnt < 0 && errno == EINTR)
+                continue;
+            if (cnt < 0 && first) {
+                close(pipeFds[0]);
+                close(pipeFds[1]);
+                return -1;
+            }
+            break;
+        }
+        first = 0;
+        while (cnt > 0) {
+            if ((moved = splice(pipeFds[0], NULL, captureFd, NULL, cnt, SPLICE_F_MOVE)) <= 0) {
+                if (moved < 0 && errno == EINTR)
+                    continue;
+                printf("error: can't write capture file: %s\n", strerror(errno));
+                close(pipeFds[0]);
+                close(pipeFds[1]);
+                return 0;
+            }
+            cnt -= moved;
+        }
+    }
+
+    close(pipeFds[0]);
+    close(pipeFds[1]);
+    return 0;
+}
+
+#endif
+
+int TerminalRun(int fd, int isSocket, const TerminalOptions *options)
+{
+    struct termios oldt, newt;
+    TerminalState state;
+    IOReactor *reactor;
+    int sts = -1;
+
+    state.fd = fd;
+    state.options = options;
+    state.filterNeeded = TerminalFilterNeeded(options);
+    state.inBuf = state.outBuf = NULL;
+    state.captureFd = -1;
+    state.display = NULL;
+    state.continueTerminal = 1;
+    TerminalFilterInit(&state.filter, options);
+
+    if (options->captureFile) {
+        if ((state.captureFd = open(options->captureFile, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+            printf("error: can't create capture file '%s': %s\n", options->captureFile, strerror(errno));
+            return -1;
+        }
+    }
+
+#ifdef LINUX
+    /* nothing needs to look at the data so let the kernel move it */
+    if (isSocket && options->headless && state.captureFd >= 0 && !options->checkForExit) {
+        if (SpliceCapture(fd, state.captureFd) == 0) {
+            close(state.captureFd);
+            return 0;
+        }
+    }
+#endif
+
+    if (!(reactor = IOReactorCreate()))
+        goto done;
+
+    if (!(state.inBuf = (uint8_t *)malloc(TERMINAL_BUFFER_SIZE)))
+        goto done;
+    if (state.filterNeeded && !(state.outBuf = (uint8_t *)malloc(TERMINAL_BUFFER_SIZE * TERMINAL_FILTER_EXPANSION)))
+        goto done;
+
+    /* a headless capture only writes the file */
+    if (!(options->headless && state.captureFd >= 0)) {
+        fflush(stdout);
+        if (!(state.display = DisplayOpen()))
+            goto done;
+    }
+
+    if (!options->headless) {
+        tcgetattr(STDIN_FILENO, &oldt);
+        newt = oldt;
+        newt.c_lflag &= ~(ICANON | ECHO | ISIG);
+        newt.c_iflag &= ~(ICRNL | INLCR);
+        newt.c_oflag &= ~OPOST;
+        tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+        IOReactorAdd(reactor, STDIN_FILENO, IO_READ, TerminalKeyboardHandler, &state);
+    }
+
+    IOReactorAdd(reactor, fd, IO_READ, TerminalTargetHandler, &state);
+
+    while (state.continueTerminal) {
+        if (IOReactorDispatch(reactor, IO_NO_DEADLINE) < 0)
+            break;
+    }
+
+    if (!options->headless)
+        tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
+
+    sts = 0;
+
+done:
+    if (state.display)
+        DisplayClose(state.display);
+    if (reactor)
+        IOReactorDestroy(reactor);
+    if (state.outBuf)
+        free(state.outBuf);
+    if (state.inBuf)
+        free(state.inBuf);
+    if (state.captureFd >= 0)
+        close(state.captureFd);
+
+    if (state.filter.sawExitValid)
+        exit(state.filter.exitCode);
+
+    return sts;
+}
+
+#endif
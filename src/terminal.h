@@ -0,0 +1,62 @@
+#ifndef __TERMINAL_H__
+#define __TERMINAL_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* bytes read from the target at a time */
+#define TERMINAL_BUFFER_SIZE    (64 * 1024)
+
+/* longest timestamp put at the start of a line ("[12345.678] ") */
+#define TERMINAL_TIMESTAMP_MAX  24
+
+/*
+ * if "checkForExit" is true, then
+ * a sequence EXIT_CHAR 00 nn indicates that we should exit
+ */
+#define TERMINAL_EXIT_CHAR      0xff
+
+/* escape from terminal mode */
+#define TERMINAL_ESC            0x1b
+
+typedef struct {
+    int checkForExit;           /* watch for the exit sequence from the target */
+    int pstMode;                /* add a linefeed after each carriage return */
+    int timestamps;             /* start each displayed line with the time since the terminal started */
+    int headless;               /* don't read the keyboard (and only write the capture file if there is one) */
+    const char *captureFile;    /* write everything received to this file unchanged */
+} TerminalOptions;
+
+/* turns the bytes received from the target into what's displayed */
+typedef struct {
+    const TerminalOptions *options;
+    int sawExitChar;
+    int sawExitValid;
+    int exitCode;
+    int done;
+    int atLineStart;
+    int64_t startTime;
+} TerminalFilter;
+
+/* the filter can produce this many bytes for each byte it's given */
+#define TERMINAL_FILTER_EXPANSION   (2 + TERMINAL_TIMESTAMP_MAX)
+
+void TerminalFilterInit(TerminalFilter *filter, const TerminalOptions *options);
+int TerminalFilterNeeded(const TerminalOptions *options);
+int TerminalFilterProcess(TerminalFilter *filter, const uint8_t *in, int len, uint8_t *out);
+
+#ifndef __MINGW32__
+
+/* run a terminal on a serial port or socket until the user or target ends it */
+int TerminalRun(int fd, int isSocket, const TerminalOptions *options);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
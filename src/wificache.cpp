@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <map>
+#include "wificache.h"
+#include "proploader.h"
+
+/*
+   The cache is a text file with one module per line:
+
+        <mac-address> TAB <ip-address> TAB <name> TAB <time-last-seen>
+
+   Modules reported by old firmware without a MAC address are keyed by
+   their IP address. The file is rewritten by writing a temporary file
+   and renaming it so readers never see a partial update.
+*/
+
+#define CACHE_FILE_NAME     ".proploader-wifi-cache"
+
+class CacheEntry {
+public:
+    CacheEntry() : m_lastSeen(0) {}
+    CacheEntry(const std::string &ipaddr, const std::string &name, time_t lastSeen) : m_ipaddr(ipaddr), m_name(name), m_lastSeen(lastSeen) {}
+    std::string m_ipaddr;
+    std::string m_name;
+    time_t m_lastSeen;
+};
+
+typedef std::map<std::string, CacheEntry> CacheEntryMap;
+
+static void ReadCacheFile(const std::string &path, CacheEntryMap &entries);
+static int WriteCacheFile(const std::string &path, CacheEntryMap &entries);
+
+WiFiModuleCache::WiFiModuleCache()
+{
+    const char *p;
+
+    /* PROPLOADER_WIFI_CACHE overrides the location and an empty value disables the cache */
+    if ((p = getenv("PROPLOADER_WIFI_CACHE")) != NULL)
+        m_path = p;
+    else if ((p = getenv("HOME")) != NULL || (p = getenv("APPDATA")) != NULL)
+        m_path = std::string(p) + "/" + CACHE_FILE_NAME;
+}
+
+/* get the cached modules (returns the number of modules found) */
+int WiFiModuleCache::load(WiFiInfoList &list, bool includeExpired)
+{
+    time_t now = time(NULL);
+    CacheEntryMap entries;
+    int cnt = 0;
+
+    if (!enabled())
+        return 0;
+
+    ReadCacheFile(m_path, entries);
+
+    CacheEntryMap::iterator i = entries.begin();
+    while (i != entries.end()) {
+        if (includeExpired || now - i->second.m_lastSeen < WIFI_CACHE_TTL) {
+            std::string mac(i->first != i->second.m_ipaddr ? i->first : "");
+            WiFiInfo info(i->second.m_name, i->second.m_ipaddr, mac);
+            info.setCached(true);
+            list.push_back(info);
+            ++cnt;
+        }
+        ++i;
+    }
+
+    return cnt;
+}
+
+/* record the modules just discovered keeping any others until they expire */
+int WiFiModuleCache::update(WiFiInfoList &list)
+{
+    time_t now = time(NULL);
+    CacheEntryMap entries;
+
+    if (!enabled())
+        return 0;
+
+    ReadCacheFile(m_path, entries);
+
+    WiFiInfoList::iterator i = list.begin();
+    while (i != list.end()) {
+        std::string key(i->macAddress()[0] ? i->macAddress() : i->address());
+
+        /* a module that moved to a new address replaces any stale entry with that address */
+        CacheEntryMap::iterator j = entries.begin();
+        while (j != entries.end()) {
+            if (j->second.m_ipaddr == i->address() && j->first != key)
+                entries.erase(j++);
+            else
+                ++j;
+        }
+
+        entries[key] = CacheEntry(i->address(), i->name(), now);
+        ++i;
+    }
+
+    /* drop entries that have expired */
+    CacheEntryMap::iterator j = entries.begin();
+    while (j != entries.end()) {
+        if (now - j->second.m_lastSeen >= WIFI_CACHE_TTL)
+            entries.erase(j++);
+        else
+            ++j;
+    }
+
+    return WriteCacheFile(m_path, entries);
+}
+
+void WiFiModuleCache::clear()
+{
+    if (enabled())
+        remove(m_path.c_str());
+}
+
+static void ReadCacheFile(const std::string &path, CacheEntryMap &entries)
+{
+    char line[256], *mac, *ipaddr, *name, *lastSeen;
+    FILE *fp;
+
+    if (!(fp = fopen(path.c_str(), "r")))
+        return;
+
+    while (fgets(line, sizeof(line), fp)) {
+        mac = line;
+        if (!(ipaddr = strchr(mac, '\t')))
+            continue;
+        *ipaddr++ = '\0';
+        if (!(name = strchr(ipaddr, '\t')))
+            continue;
+        *name++ = '\0';
+        if (!(lastSeen = strchr(name, '\t')))
+            continue;
+        *lastSeen++ = '\0';
+        entries[mac] = CacheEntry(ipaddr, name, (time_t)strtoll(lastSeen, NULL, 10));
+    }
+
+    fclose(fp);
+}
+
+static int WriteCacheFile(const std::string &path, CacheEntryMap &entries)
+{
+    static std::atomic<int> writeCount(0);
+    char suffix[32];
+    FILE *fp;
+
+    /* each writer uses its own temporary file so concurrent updates can't interleave */
+    snprintf(suffix, sizeof(suffix), ".%ld.%d.tmp", (long)getpid(), ++writeCount);
+    std::string tmpPath = path + suffix;
+
+    if (!(fp = fopen(tmpPath.c_str(), "w")))
+        return -1;
+
+    CacheEntryMap::iterator i = entries.begin();
+    while (i != entries.end()) {
+        fprintf(fp, "%s\t%s\t%s\t%lld\n", i->first.c_str(), i->second.m_ipaddr.c_str(), i->second.m_name.c_str(), (long long)i->second.m_lastSeen);
+        ++i;
+    }
+
+    if (fclose(fp) != 0) {
+        remove(tmpPath.c_str());
+        return -1;
+    }
+
+#ifdef __MINGW32__
+    /* rename doesn't replace an existing file on windows */
+    remove(path.c_str());
+#endif
+
+    if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+        remove(tmpPath.c_str());
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef __WIFICACHE_H__
+#define __WIFICACHE_H__
+
+#include <string>
+#include "wifipropconnection.h"
+
+// how long a discovered module is trusted without being seen again (seconds)
+#define WIFI_CACHE_TTL      300
+
+// cache of discovered wifi modules keyed by MAC address
+class WiFiModuleCache {
+public:
+    WiFiModuleCache();
+    bool enabled() { return !m_path.empty(); }
+    int load(WiFiInfoList &list, bool includeExpired = false);
+    int update(WiFiInfoList &list);
+    void clear();
+private:
+    std::string m_path;
+};
+
+#endif
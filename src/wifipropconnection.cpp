@@ -1,7 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <thread>
+#include <unordered_set>
 #include "wifipropconnection.h"
+#include "wificache.h"
 #include "proploader.h"
 
 #define CALIBRATE_DELAY 10
@@ -10,10 +13,22 @@
 #define TELNET_PORT     23
 #define DISCOVER_PORT   32420
 
+/* the fast loader sends small packets and waits for a short response to each so tune the telnet socket for latency */
+static const SocketOptions telnetSocketOptions = {
+    1,              // no Nagle delay before sending a small packet
+    1,              // acknowledge responses immediately
+    16 * 1024,      // room for several full size packets
+    0               // default receive buffer
+};
+
+std::thread WiFiPropConnection::m_refreshThread;
+
 WiFiPropConnection::WiFiPropConnection()
     : m_ipaddr(NULL),
       m_version(NULL),
-      m_telnetSocket(INVALID_SOCKET)
+      m_telnetSocket(INVALID_SOCKET),
+      m_loadSocket(INVALID_SOCKET),
+      m_loadError(NULL)
 {
     m_loaderBaudRate = WIFI_LOADER_BAUD_RATE;
     m_fastLoaderBaudRate = WIFI_FAST_LOADER_BAUD_RATE;
@@ -22,6 +37,7 @@ WiFiPropConnection::WiFiPropConnection()
 
 WiFiPropConnection::~WiFiPropConnection()
 {
+    cancelLoad();
     if (m_ipaddr)
         free(m_ipaddr);
     disconnect();
@@ -78,6 +94,9 @@ int WiFiPropConnection::connect()
     if (ConnectSocketTimeout(&m_telnetAddr, CONNECT_TIMEOUT, &m_telnetSocket) != 0)
         return -1;
 
+    if (SetSocketOptions(m_telnetSocket, &telnetSocketOptions) != 0)
+        message("Setting telnet socket options failed");
+
     return 0;
 }
 
@@ -88,6 +107,9 @@ int WiFiPropConnection::disconnect()
         
     CloseSocket(m_telnetSocket);
     m_telnetSocket = INVALID_SOCKET;
+
+    if (SocketPartialReadCount() > 0)
+        message("%d exact socket receives arrived in pieces", SocketPartialReadCount());
     
     return 0;
 }
@@ -101,9 +123,10 @@ int WiFiPropConnection::loadImage(const uint8_t *image, int imageSize, uint8_t *
 {
     uint8_t buffer[1024], *packet, *p;
     int hdrCnt, result, cnt;
+    SOCKET sock;
     
     /* use the initial loader baud rate */
-    if (setBaudRate(loaderBaudRate()) != 0) 
+    if (waitForStartLoad(&sock) != 0) 
         return -1;
         
     hdrCnt = snprintf((char *)buffer, sizeof(buffer), "\
@@ -111,13 +134,19 @@ POST /propeller/load?baud-rate=%d&response-size=%d&response-timeout=1000 HTTP/1.
 Content-Length: %d\r\n\
 \r\n", loaderBaudRate(), responseSize, imageSize);
 
-    if (!(packet = (uint8_t *)malloc(hdrCnt + imageSize)))
+    if (!(packet = (uint8_t *)malloc(hdrCnt + imageSize))) {
+        if (sock != INVALID_SOCKET)
+            CloseSocket(sock);
         return -1;
+    }
 
     memcpy(packet,  buffer, hdrCnt);
     memcpy(&packet[hdrCnt], image, imageSize);
     
-    if ((cnt = sendRequest(packet, hdrCnt + imageSize, buffer, sizeof(buffer), &result)) == -1) {
+    cnt = sendRequest(packet, hdrCnt + imageSize, buffer, sizeof(buffer), &result, sock);
+    free(packet);
+    
+    if (cnt == -1) {
         message("Load request failed");
         return -1;
     }
@@ -150,10 +179,11 @@ Content-Length: %d\r\n\
 int WiFiPropConnection::loadImage(const uint8_t *image, int imageSize, LoadType loadType)
 {
     uint8_t buffer[1024], *packet;
-    int hdrCnt, result;
+    int hdrCnt, result, cnt;
+    SOCKET sock;
     
     /* use the initial loader baud rate */
-    if (setBaudRate(loaderBaudRate()) != 0) 
+    if (waitForStartLoad(&sock) != 0) 
         return -1;
         
     hdrCnt = snprintf((char *)buffer, sizeof(buffer), "\
@@ -161,13 +191,19 @@ POST /propeller/load?baud-rate=%d HTTP/1.1\r\n\
 Content-Length: %d\r\n\
 \r\n", loaderBaudRate(), imageSize);
 
-    if (!(packet = (uint8_t *)malloc(hdrCnt + imageSize)))
+    if (!(packet = (uint8_t *)malloc(hdrCnt + imageSize))) {
+        if (sock != INVALID_SOCKET)
+            CloseSocket(sock);
         return -1;
+    }
 
     memcpy(packet,  buffer, hdrCnt);
     memcpy(&packet[hdrCnt], image, imageSize);
     
-    if (sendRequest(packet, hdrCnt + imageSize, buffer, sizeof(buffer), &result) == -1) {
+    cnt = sendRequest(packet, hdrCnt + imageSize, buffer, sizeof(buffer), &result, sock);
+    free(packet);
+    
+    if (cnt == -1) {
         message("Load request failed");
         return -1;
     }
@@ -179,20 +215,148 @@ Content-Length: %d\r\n\
     return 0;
 }
 
+/* set the loader baud rate and connect for the load request while the caller prepares the image */
+int WiFiPropConnection::startLoad()
+{
+    cancelLoad();
+    m_loadError = NULL;
+    m_loadThread = std::thread(&WiFiPropConnection::runStartLoad, this);
+    return 0;
+}
+
+/* messages are per thread so this only records what failed for waitForStartLoad to report */
+void WiFiPropConnection::runStartLoad()
+{
+    if (setBaudRate(loaderBaudRate()) != 0)
+        m_loadError = "Set baud-rate request failed";
+    else if (ConnectSocketTimeout(&m_httpAddr, CONNECT_TIMEOUT, &m_loadSocket) != 0)
+        m_loadError = "Connect failed";
+}
+
+void WiFiPropConnection::cancelLoad()
+{
+    if (m_loadThread.joinable())
+        m_loadThread.join();
+    if (m_loadSocket != INVALID_SOCKET) {
+        CloseSocket(m_loadSocket);
+        m_loadSocket = INVALID_SOCKET;
+    }
+}
+
+/* pick up the work done by startLoad or do it now if it wasn't called */
+int WiFiPropConnection::waitForStartLoad(SOCKET *pSock)
+{
+    *pSock = INVALID_SOCKET;
+    
+    if (!m_loadThread.joinable())
+        return setBaudRate(loaderBaudRate());
+    
+    m_loadThread.join();
+    if (m_loadError) {
+        message("%s", m_loadError);
+        cancelLoad();
+        return -1;
+    }
+    
+    *pSock = m_loadSocket;
+    m_loadSocket = INVALID_SOCKET;
+    return 0;
+}
+
 #define MAX_IF_ADDRS    20
 #define NAME_TAG        "\"name\": \""
 #define MACADDR_TAG     "\"mac address\": \""
 
-int WiFiPropConnection::findModules(bool show, WiFiInfoList &list, int count)
+/*
+ * With refresh a search answered from the cache revalidates it in the
+ * background. Only a process that keeps running (the daemon) should ask
+ * for that since the refresh has to be finished with
+ * finishModuleCacheRefresh before the process exits.
+ */
+int WiFiPropConnection::findModules(bool show, WiFiInfoList &list, int count, bool useCache, bool refresh)
+{
+    WiFiModuleCache cache;
+    WiFiInfoList probes;
+    int sts;
+
+    /* don't let two searches update the cache at the same time */
+    finishModuleCacheRefresh();
+
+    if (cache.enabled()) {
+
+        /* answer from the cache when it has enough modules that are still fresh */
+        if (useCache && !show && count > 0) {
+            WiFiInfoList cached;
+            if (cache.load(cached) >= count) {
+                WiFiInfoList::iterator i = cached.begin();
+                while (count > 0) {
+                    message("Using cached module: %s", i->address());
+                    list.push_back(*i++);
+                    --count;
+                }
+                if (refresh) {
+                    cache.load(probes, true);
+                    m_refreshThread = std::thread(refreshModuleCache, probes);
+                }
+                return 0;
+            }
+        }
+
+        /* probe every module we've seen before even if its entry has expired */
+        cache.load(probes, true);
+    }
+
+    if ((sts = discoverModules(show, list, count, probes)) == 0)
+        cache.update(list);
+
+    return sts;
+}
+
+void WiFiPropConnection::finishModuleCacheRefresh()
+{
+    if (m_refreshThread.joinable())
+        m_refreshThread.join();
+}
+
+/* messages are per thread and verbose is off here so the refresh doesn't print anything */
+void WiFiPropConnection::refreshModuleCache(WiFiInfoList probes)
+{
+    WiFiModuleCache cache;
+    WiFiInfoList list;
+    if (discoverModules(false, list, -1, probes) == 0)
+        cache.update(list);
+}
+
+int WiFiPropConnection::discoverModules(bool show, WiFiInfoList &list, int count, WiFiInfoList &probes)
 {
     uint8_t txBuf[1024]; // BUG: get rid of this magic number!
     uint8_t rxBuf[1024]; // BUG: get rid of this magic number!
     IFADDR ifaddrs[MAX_IF_ADDRS];
+    std::unordered_set<uint32_t> found;
+    std::list<SOCKADDR_IN> probeAddrs;
     uint32_t *txNext;
     int ifCnt, tries, txCnt, cnt, i;
     SOCKADDR_IN addr;
     SOCKET sock;
     
+    /* remember the modules already in the list so they aren't reported twice */
+    WiFiInfoList::iterator j = list.begin();
+    while (j != list.end()) {
+        uint32_t a;
+        if (StringToAddr(j->address(), &a) == 0)
+            found.insert(a);
+        ++j;
+    }
+
+    /* build the addresses of previously seen modules to probe directly */
+    j = probes.begin();
+    while (j != probes.end()) {
+        if (GetInternetAddress(j->address(), DISCOVER_PORT, &addr) == 0)
+            probeAddrs.push_back(addr);
+        ++j;
+    }
+
+    
     /* get all of the network interface addresses */
     if ((ifCnt = GetInterfaceAddresses(ifaddrs, MAX_IF_ADDRS)) < 0) {
         message("GetInterfaceAddresses failed");
@@ -232,6 +396,14 @@ int WiFiPropConnection::findModules(bool show, WiFiInfoList &list, int count)
                 return -1;
             }
         }
+
+        /* send the same packet directly to the modules we've seen before in case broadcasts are filtered or lost */
+        std::list<SOCKADDR_IN>::iterator k = probeAddrs.begin();
+        while (k != probeAddrs.end()) {
+            if (found.find(k->sin_addr.s_addr) == found.end())
+                SendSocketDataTo(sock, txBuf, txCnt, &*k);
+            ++k;
+        }
     
         /* receive wifi module responses */
         while (SocketDataAvailableP(sock, DISCOVER_REPLY_TIMEOUT)) {
@@ -252,18 +424,10 @@ int WiFiPropConnection::findModules(bool show, WiFiInfoList &list, int count)
                 char macAddrBuffer[128];
                 
                 /* make sure we don't already have a response from this module */
-                WiFiInfoList::iterator i = list.begin();
-                bool skip = false;
-                while (i != list.end()) {
-                    if (i->address() == addressStr) {
-                        message("Skipping duplicate: %s", AddressToString(&addr));
-                        skip = true;
-                        break;
-                    }
-                    ++i;
-                }
-                if (skip)
+                if (!found.insert(addr.sin_addr.s_addr).second) {
+                    message("Skipping duplicate: %s", addressStr.c_str());
                     continue;
+                }
                     
                 /* count this as a module found on this attempt */
                 ++numberFound;
@@ -319,7 +483,7 @@ int WiFiPropConnection::findModules(bool show, WiFiInfoList &list, int count)
                     printf("\n");
                 }
                 
-                WiFiInfo info(name, addressStr);
+                WiFiInfo info(name, addressStr, macAddr);
                 list.push_back(info);
             
                 if (count > 0 && --count == 0) {
@@ -460,16 +624,24 @@ int WiFiPropConnection::sendData(const uint8_t *buf, int len)
 
 int WiFiPropConnection::receiveDataTimeout(uint8_t *buf, int len, int timeout)
 {
+    int cnt;
     if (!isOpen())
         return -1;
-    return ReceiveSocketDataTimeout(m_telnetSocket, buf, len, timeout);
+    cnt = ReceiveSocketDataTimeout(m_telnetSocket, buf, len, timeout);
+    if (telnetSocketOptions.quickAck)
+        SocketQuickAck(m_telnetSocket);
+    return cnt;
 }
 
 int WiFiPropConnection::receiveDataExactTimeout(uint8_t *buf, int len, int timeout)
 {
+    int cnt;
     if (!isOpen())
         return -1;
-    return ReceiveSocketDataExactTimeout(m_telnetSocket, buf, len, timeout);
+    cnt = ReceiveSocketDataExactTimeout(m_telnetSocket, buf, len, timeout);
+    if (telnetSocketOptions.quickAck)
+        SocketQuickAck(m_telnetSocket);
+    return cnt;
 }
 
 int WiFiPropConnection::setBaudRate(int baudRate)
@@ -498,21 +670,21 @@ POST /wx/setting?name=baud-rate&value=%d HTTP/1.1\r\n\
     return 0;
 }
 
-int WiFiPropConnection::terminal(bool checkForExit, bool pstMode)
+int WiFiPropConnection::terminal(const TerminalOptions *options)
 {
     if (!isOpen())
         return -1;
-    SocketTerminal(m_telnetSocket, checkForExit, pstMode);
+    SocketTerminal(m_telnetSocket, options);
     return 0;
 }
 
-int WiFiPropConnection::sendRequest(uint8_t *req, int reqSize, uint8_t *res, int resMax, int *pResult)
+/* sock is a connection already made to the module or INVALID_SOCKET to make a new one */
+int WiFiPropConnection::sendRequest(uint8_t *req, int reqSize, uint8_t *res, int resMax, int *pResult, SOCKET sock)
 {
-    SOCKET sock;
     char buf[80];
     int cnt;
     
-    if (ConnectSocketTimeout(&m_httpAddr, CONNECT_TIMEOUT, &sock) != 0) {
+    if (sock == INVALID_SOCKET && ConnectSocketTimeout(&m_httpAddr, CONNECT_TIMEOUT, &sock) != 0) {
         message("Connect failed");
         return -1;
     }
@@ -524,17 +696,17 @@ int WiFiPropConnection::sendRequest(uint8_t *req, int reqSize, uint8_t *res, int
     
     if (SendSocketData(sock, req, reqSize) != reqSize) {
         message("Send request failed");
-        CloseSocket(sock);
+        AbortSocket(sock);
         return -1;
     }
     
-    cnt = ReceiveSocketDataTimeout(sock, res, resMax, 10000);
-    CloseSocket(sock);
-
-    if (cnt == -1) {
+    /* don't wait for a module that isn't responding to close the connection */
+    if ((cnt = ReceiveSocketDataTimeout(sock, res, resMax, 10000)) == -1) {
         message("Receive response failed");
+        AbortSocket(sock);
         return -1;
     }
+    CloseSocket(sock);
     
     if (verbose > 1) {
         printf("RES: %d\n", cnt);
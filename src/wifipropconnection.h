@@ -3,6 +3,7 @@
 
 #include <string>
 #include <list>
+#include <thread>
 #include "propconnection.h"
 #include "sock.h"
 
@@ -21,12 +22,17 @@
 class WiFiInfo {
 public:
     WiFiInfo() {}
-    WiFiInfo(std::string name, std::string address) : m_name(name), m_address(address) {}
+    WiFiInfo(std::string name, std::string address, std::string macAddress = "") : m_name(name), m_address(address), m_macAddress(macAddress), m_cached(false) {}
     const char *name() { return m_name.c_str(); }
     const char *address() { return m_address.c_str(); }
+    const char *macAddress() { return m_macAddress.c_str(); }
+    bool cached() { return m_cached; }
+    void setCached(bool cached) { m_cached = cached; }
 private:
     std::string m_name;
     std::string m_address;
+    std::string m_macAddress;
+    bool m_cached;
 };
 
 typedef std::list<WiFiInfo> WiFiInfoList;
@@ -53,11 +59,18 @@ public:
     int receiveDataExactTimeout(uint8_t *buf, int len, int timeout);
     int setBaudRate(int baudRate);
     int maxDataSize() { return 1024; }
-    int terminal(bool checkForExit, bool pstMode);
-    static int findModules(bool show, WiFiInfoList &list, int count = -1);
+    int terminal(const TerminalOptions *options);
+    int startLoad();
+    void cancelLoad();
+    static int findModules(bool show, WiFiInfoList &list, int count = -1, bool useCache = true, bool refresh = false);
+    static void finishModuleCacheRefresh();
 private:
+    static int discoverModules(bool show, WiFiInfoList &list, int count, WiFiInfoList &probes);
+    static void refreshModuleCache(WiFiInfoList probes);
     int getVersion();
-    int sendRequest(uint8_t *req, int reqSize, uint8_t *res, int resMax, int *pResult);
+    void runStartLoad();
+    int waitForStartLoad(SOCKET *pSock);
+    int sendRequest(uint8_t *req, int reqSize, uint8_t *res, int resMax, int *pResult, SOCKET sock = INVALID_SOCKET);
     static void dumpHdr(const uint8_t *buf, int size);
     static void dumpResponse(const uint8_t *buf, int size);
     char *m_ipaddr;
@@ -65,6 +78,10 @@ private:
     SOCKADDR_IN m_httpAddr;
     SOCKADDR_IN m_telnetAddr;
     SOCKET m_telnetSocket;
+    std::thread m_loadThread;
+    static std::thread m_refreshThread;
+    SOCKET m_loadSocket;        /* load request connection opened by startLoad */
+    const char *m_loadError;
 };
 
 #endif // WIFIPROPELLERCONNECTION_H